@@ -0,0 +1,110 @@
+#include "chunk_dirs.hpp"
+
+#include "../log.hpp"
+#include "../tools/file.hpp"
+
+std::string chunk_id::to_full_filename() const
+{
+        return std::string(chunk_dirs::instance().dir(*this)) + "/"
+                + to_filename();
+}
+
+chunk_dirs& chunk_dirs::instance()
+{
+        static chunk_dirs dirs;
+
+        return dirs;
+}
+
+void chunk_dirs::create()
+{
+        for (const char* path : CONFIG_CHUNK_DIRS)
+                if (!check_dir_exist(path))
+                        create_directory(path);
+}
+
+const char* chunk_dirs::dir(const chunk_id& id) const
+{
+        return CONFIG_CHUNK_DIRS[_index(id)];
+}
+
+void chunk_dirs::place(const chunk_id& output,
+                       const std::vector<chunk_id>& inputs, uint64_t size)
+{
+        if (dirs_n == 1)
+                return;
+
+        std::array<bool, dirs_n> used{};
+
+        for (auto& id : inputs)
+                used[_index(id)] = true;
+
+        std::lock_guard<std::mutex> lk(lock_);
+
+        if (frozen_.load(std::memory_order_relaxed))
+                THROW_EXCEPTION << "The run " << output
+                                << " is placed after the merge plan";
+
+        auto load = [this](std::size_t i) {
+                return devices_[i].written + devices_[i].planned;
+        };
+
+        std::size_t best = dirs_n;
+
+        /* all the directories are taken by the inputs if the fan-in is
+         * not less than their number, then it's just the least loaded */
+        for (int pass = 0; pass < 2 && best == dirs_n; ++pass)
+                for (std::size_t i = 0; i < dirs_n; ++i)
+                        if ((pass || !used[i])
+                            && (best == dirs_n || load(i) < load(best)))
+                                best = i;
+
+        devices_[best].planned += size;
+        placed_[output] = best;
+}
+
+void chunk_dirs::freeze()
+{
+        std::lock_guard<std::mutex> lk(lock_);
+
+        frozen_.store(true, std::memory_order_release);
+}
+
+void chunk_dirs::written(const chunk_id& id, uint64_t size)
+{
+        devices_[_index(id)].written += size;
+}
+
+void chunk_dirs::read(const chunk_id& id, uint64_t size)
+{
+        devices_[_index(id)].read += size;
+}
+
+void chunk_dirs::log_stats() const
+{
+        for (std::size_t i = 0; i < dirs_n; ++i)
+                info() << "Scratch " << quote(CONFIG_CHUNK_DIRS[i])
+                       << ": written " << size_format(devices_[i].written)
+                       << ", read " << size_format(devices_[i].read);
+}
+
+/* the L0 runs and anything not placed go round robin by id */
+std::size_t chunk_dirs::_index(const chunk_id& id) const
+{
+        if (dirs_n == 1)
+                return 0;
+
+        if (frozen_.load(std::memory_order_acquire))
+                return _find(id);
+
+        std::lock_guard<std::mutex> lk(lock_);
+
+        return _find(id);
+}
+
+std::size_t chunk_dirs::_find(const chunk_id& id) const
+{
+        auto found = placed_.find(id);
+
+        return found != placed_.end() ? found->second : id.id % dirs_n;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include "chunk_id.hpp"
+
+/* The scratch directories of CONFIG_CHUNK_DIRS, one per device. The L0 runs
+ * are striped across them by id, every merge output is placed when the
+ * merge plan is built: on the least loaded directory none of the merge
+ * inputs is in, so a merge reads from some devices while it writes to
+ * another one */
+class chunk_dirs
+{
+        static constexpr std::size_t dirs_n =
+                std::extent<decltype(CONFIG_CHUNK_DIRS)>::value;
+
+        static_assert(dirs_n > 0, "CONFIG_CHUNK_DIRS must not be empty");
+public:
+        static chunk_dirs& instance();
+
+        chunk_dirs(const chunk_dirs&) = delete;
+        chunk_dirs& operator=(const chunk_dirs&) = delete;
+
+        /* creates the missing directories */
+        void create();
+
+        const char* dir(const chunk_id& id) const;
+
+        /* chooses the directory of a merge output of size bytes */
+        void place(const chunk_id& output, const std::vector<chunk_id>& inputs,
+                   uint64_t size);
+
+        /* the merge plan is built, the placement doesn't change anymore and
+         * the lookups of the merges don't take the lock */
+        void freeze();
+
+        /* the byte counters of the directory of the run */
+        void written(const chunk_id& id, uint64_t size);
+        void read(const chunk_id& id, uint64_t size);
+
+        void log_stats() const;
+private:
+        chunk_dirs() = default;
+
+        std::size_t _index(const chunk_id& id) const;
+        std::size_t _find(const chunk_id& id) const;
+private:
+        struct device
+        {
+                std::atomic<uint64_t> written{0};
+                std::atomic<uint64_t> read{0};
+
+                /* bytes of the merge outputs placed, but not written yet */
+                uint64_t planned = 0;
+        };
+
+        std::array<device, dirs_n> devices_;
+
+        mutable std::mutex lock_;
+        std::map<chunk_id, std::size_t> placed_;
+        std::atomic<bool> frozen_{false};
+};
@@ -81,10 +81,8 @@ struct chunk_id
                         + format::to_hex_string(id);
         }
 
-        std::string to_full_filename() const
-        {
-                return std::string(CONFIG_CHUNK_DIR) + "/" + to_filename();
-        }
+        /* in the scratch directory of the run, see chunk_dirs */
+        std::string to_full_filename() const;
 
         union
         {
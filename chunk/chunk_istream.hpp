@@ -1,9 +1,19 @@
 #pragma once
+#include <unistd.h>
 #include "chunk_id.hpp"
 #include "chunk_stream.hpp"
+#include "run_codec.hpp"
+#include "run_footer.hpp"
 #include "../tools/exception.hpp"
+#include "../tools/file.hpp"
+#include "../tools/io_worker.hpp"
 #include "../tools/mapped_file.hpp"
+#include "../tools/util.hpp"
+#include "../tools/span.hpp"
+#include "../tools/uring.hpp"
 
+/* The runs are read by the shared I/O worker into two buffers, one of them
+ * is consumed by the merge while the next one is being filled */
 template<typename T>
 class _chunk_istream<T, chunk_stream_cpp>
 {
@@ -31,63 +41,111 @@ public:
 
         void open(std::string&& filename, size_t buff_size)
         {
-                read_ = 0;
                 buff_size_ = buff_size;
-                buff_elem_n_ = get_buff_elem_n(buff_size);
-                buffer_.resize(buff_elem_n_);
 
-                is_.open(filename, std::ios::in | std::ios::binary);
+                is_.reset(new std::ifstream);
 
-                if (!is_)
+                /* the blocks are read straight to our buffers */
+                is_->rdbuf()->pubsetbuf(nullptr, 0);
+                is_->open(filename, std::ios::in | std::ios::binary);
+
+                if (!*is_)
                         THROW_FILE_EXCEPTION(filename) << "Cannot open the file";
 
-                is_.rdbuf()->pubsetbuf((char*)&buffer_[0], buff_size);
+                taken_ = 0;
 
-                is_.seekg(0, std::ios::end);
-                file_size_ = is_.tellg();
-                is_.seekg(0, std::ios::beg);
+                if (punch_holes_)
+                        punch_.open(filename, CONFIG_PUNCH_HOLES_STEP);
+
+                is_->seekg(0, std::ios::end);
+                file_size_ = is_->tellg();
+                is_->seekg(0, std::ios::beg);
+
+                file_size_ = footer_.open(filename, run_trailer::codec_raw,
+                                          file_size_);
 
                 if (file_size_ % elem_size)
                         THROW_FILE_EXCEPTION(filename) 
                                 << "File is broken, the size must be a product of "
                                 << elem_size;
 
-                if (!next())
+                auto is = is_.get();
+                uint64_t end = file_size_;
+
+                /* the footer isn't read as data */
+                ra_.open(get_block_size(buff_size),
+                [is, filename, end](char* data, std::size_t size) -> std::size_t
+                {
+                        uint64_t pos = is->tellg();
+                        is->read(data, std::min<uint64_t>(size, end - pos));
+
+                        if (is->bad())
+                                THROW_FILE_EXCEPTION(filename)
+                                        << "Cannot read the file";
+
+                        return is->gcount();
+                });
+
+                if (!_next_block())
                         THROW_EXCEPTION << "Can't read the file " << filename
                                 << " seems like it's empty";
         }
 
-        const T& value() const { return val_; }
+        const T& value() const { return *cur_; }
 
         bool next()
         {
-                if (read_ >= file_size_)
-                        return false;
+                if (++cur_ != end_)
+                        return true;
 
-                is_.read((char*)&val_, elem_size);
+                return _next_block();
+        }
+        bool eof() const { return cur_ == end_; }
 
-                if (!is_.eof() && is_.bad())
-                        THROW_FILE_EXCEPTION(id().to_full_filename())
-                                << "Cannot read the file";
+        void release() noexcept
+        {
+                ra_.close();
+                punch_.close();
+                is_.reset();
+                cur_ = end_ = nullptr;
+        }
 
-                auto r = is_.gcount();
-                read_ += r;
+        /* the file is punched out as it's read, set before open() */
+        void punch_holes(bool enable) { punch_holes_ = enable; }
 
-                return r == elem_size;
-        }
-        bool eof() const { return is_.eof() || read_ >= file_size_; }
+        /* the values are verified against the run footer, set before
+         * open() */
+        void footer(bool enable) { footer_.enable(enable); }
 
-        void release() noexcept
+        void copy_to(_chunk_ostream<T, chunk_stream_cpp>& os)
         {
-                is_ = decltype(is_)();
-                buffer_ = std::vector<T>();
+                do
+                {
+                        os.write(cur_, end_ - cur_);
+                }
+                while (_next_block());
         }
 
-        void copy_to(chunk_ostream<T>& os)
+        /* copies up to n elements from the current one on and moves past
+         * them, less than n only at the end */
+        std::size_t read(T* data, std::size_t n)
         {
-                os.put(value());
+                std::size_t done = 0;
+
+                while (done < n && cur_ != end_)
+                {
+                        std::size_t k = std::min<std::size_t>(n - done,
+                                                              end_ - cur_);
+
+                        mem_copy(data + done, cur_, k * sizeof(T));
+                        cur_ += k;
+                        done += k;
 
-                os.os_ << is_.rdbuf();
+                        if (cur_ == end_)
+                                _next_block();
+                }
+
+                return done;
         }
 
         chunk_id id() const { return id_; }
@@ -97,28 +155,68 @@ public:
 
         size_t buff_size() const { return buff_size_; }
 
+        /* bytes read from the file so far */
+        uint64_t bytes_read() const { return taken_; }
+
 private:
-        static size_t get_buff_elem_n(size_t buff_size)
+        /* half of the buffer is read while the other half is consumed */
+        static size_t get_block_size(size_t buff_size)
         {
                 if (buff_size % elem_size)
                         THROW_EXCEPTION << "buff_size="
                                 << buff_size
                                 << " must be a product of "
-                                << elem_size;
+                                << sizeof(T);
 
-                return buff_size / elem_size;
+                return std::max(round_down(buff_size / 2, sizeof(T)),
+                                sizeof(T));
+        }
+
+        /* the block stays valid until the next one is requested */
+        bool _next_block()
+        {
+                std::size_t size;
+                auto p = ra_.next_block(size);
+
+                cur_ = reinterpret_cast<const T*>(p);
+                end_ = cur_ + size / elem_size;
+
+                /* the block is in memory, it isn't needed in the file */
+                taken_ += size;
+                punch_.consumed(taken_);
+
+                _check_block();
+
+                return cur_ != end_;
+        }
+
+        void _check_block()
+        {
+                if (cur_ != end_)
+                        footer_.check(cur_, end_ - cur_);
+                else
+                        footer_.finish();
         }
 private:
         chunk_id id_;
         size_t buff_size_ = 0;
-        size_t buff_elem_n_ = 0;
-        std::vector<T> buffer_;
-        std::ifstream is_;
-        T val_ = T();
+        /* a moved-in stream waits for the read in flight before the
+         * file is replaced */
+        read_ahead ra_;
+        std::unique_ptr<std::ifstream> is_;
+        const T* cur_ = nullptr;
+        const T* end_ = nullptr;
         uint64_t file_size_ = 0;
-        uint64_t read_ = 0;
+
+        bool punch_holes_ = false;
+        hole_puncher punch_;
+        uint64_t taken_ = 0;
+
+        run_footer_reader<T> footer_;
 };
 
+/* Same double buffering as the C++ streams, the tail of the last run is
+ * copied inside the kernel */
 template<typename T>
 class _chunk_istream<T, chunk_stream_stdio>
 {
@@ -148,72 +246,145 @@ public:
         {
                 read_ = 0;
                 buff_size_ = buff_size;
-                buff_elem_n_ = get_buff_elem_n(buff_size);
-                buffer_.resize(buff_elem_n_);
 
-                is_ = fopen(filename.c_str(), "rb");
+                is_.reset(fopen(filename.c_str(), "rb"));
 
                 if (!is_)
                         THROW_FILE_EXCEPTION(filename) << "Cannot open the file";
 
-                setvbuf(is_, (char*)&buffer_[0], _IOFBF, buff_size);
+                if (punch_holes_)
+                        punch_.open(filename, CONFIG_PUNCH_HOLES_STEP);
+
+                setvbuf(is_.get(), nullptr, _IONBF, 0);
+
+                fseek(is_.get(), 0, SEEK_END);
+                file_size_ = ftell(is_.get());
+                rewind(is_.get());
 
-                fseek(is_, 0, SEEK_END);
-                file_size_ = ftell(is_);
-                rewind(is_);
+                file_size_ = footer_.open(filename, run_trailer::codec_raw,
+                                          file_size_);
 
                 if (file_size_ % elem_size)
                         THROW_FILE_EXCEPTION(filename) 
                         << "File is broken, the size must be a product of "
                                 << elem_size;
 
-                if (!next())
+                auto is = is_.get();
+                uint64_t end = file_size_;
+
+                /* the footer isn't read as data */
+                ra_.open(get_block_size(buff_size),
+                [is, filename, end](char* data, std::size_t size) -> std::size_t
+                {
+                        uint64_t pos = ftello(is);
+                        size_t r = fread(data, 1,
+                                         std::min<uint64_t>(size, end - pos),
+                                         is);
+
+                        if (ferror(is))
+                                THROW_FILE_EXCEPTION(filename)
+                                        << "Cannot read the file";
+
+                        return r;
+                });
+
+                if (!_next_block())
                         THROW_FILE_EXCEPTION(filename) 
                         << "Can't read the file seems like it's empty";
         }
 
-        const T& value() const { return val_; }
+        const T& value() const { return *cur_; }
 
         bool next()
         {
-                if (read_ >= file_size_)
-                        return false;
+                if (++cur_ != end_)
+                        return true;
 
-                size_t r = fread((char*)&val_, 1, elem_size, is_);
+                return _next_block();
+        }
+        bool eof() const { return cur_ == end_; }
 
-                if (ferror(is_))
-                        THROW_FILE_EXCEPTION(id().to_full_filename())
-                                             << "Cannot read the file";
+        void release() noexcept
+        {
+                ra_.close();
+                punch_.close();
 
-                read_ += r;
+                is_.reset();
 
-                return r == elem_size;
+                cur_ = end_ = nullptr;
         }
-        bool eof() const { return feof(is_) || read_ >= file_size_; }
 
-        void release() noexcept
+        /* the file is punched out as it's read, set before open() */
+        void punch_holes(bool enable) { punch_holes_ = enable; }
+
+        /* the values are verified against the run footer, set before
+         * open() */
+        void footer(bool enable) { footer_.enable(enable); }
+
+        void copy_to(_chunk_ostream<T, chunk_stream_stdio>& os)
         {
-                if (is_)
+                os.write(cur_, end_ - cur_);
+                cur_ = end_;
+
+                /* the tail is copied inside the kernel, the block read
+                 * ahead is dropped and the output is flushed first */
+                ra_.close();
+                os.flush();
+
+                off_t out_pos = ftello(os.os_.get());
+                uint64_t from = read_;
+                uint64_t left = file_size_ - read_;
+
+                uint64_t copied = file_copy_range(fileno(is_.get()), read_,
+                                                  fileno(os.os_.get()), out_pos,
+                                                  left);
+                read_ += copied;
+
+                fseeko(is_.get(), read_, SEEK_SET);
+                fseeko(os.os_.get(), out_pos + copied, SEEK_SET);
+
+                char buff[PAGE_SIZE];
+
+                while (read_ < file_size_)
                 {
-                        fclose(is_);
-                        is_ = nullptr;
+                        size_t r = fread(buff, 1, PAGE_SIZE, is_.get());
+
+                        if (r == 0)
+                                THROW_FILE_EXCEPTION(id().to_full_filename())
+                                        << "Cannot read the file";
+
+                        if (fwrite(buff, 1, r, os.os_.get()) != r)
+                                THROW_FILE_EXCEPTION(os.filename())
+                                        << "Cannot write the file";
+
+                        read_ += r;
                 }
 
-                buffer_ = std::vector<T>();
+                os.bytes_written_ += read_ - from;
+
+                _sum_copied(os, from);
         }
 
-        void copy_to(chunk_ostream<T>& os)
+        /* copies up to n elements from the current one on and moves past
+         * them, less than n only at the end */
+        std::size_t read(T* data, std::size_t n)
         {
-                os.put(value());
+                std::size_t done = 0;
 
-                char buff[PAGE_SIZE];
-                
-                while (!feof(is_))
+                while (done < n && cur_ != end_)
                 {
-                        size_t r = fread(buff, 1, PAGE_SIZE, is_);
+                        std::size_t k = std::min<std::size_t>(n - done,
+                                                              end_ - cur_);
+
+                        mem_copy(data + done, cur_, k * sizeof(T));
+                        cur_ += k;
+                        done += k;
 
-                        fwrite(buff, 1, r, os.os_);
+                        if (cur_ == end_)
+                                _next_block();
                 }
+
+                return done;
         }
 
         chunk_id id() const { return id_; }
@@ -223,26 +394,251 @@ public:
 
         size_t buff_size() const { return buff_size_; }
 
+        /* bytes read from the file so far */
+        uint64_t bytes_read() const { return read_; }
+
 private:
-        static size_t get_buff_elem_n(size_t buff_size)
+        /* half of the buffer is read while the other half is consumed */
+        static size_t get_block_size(size_t buff_size)
         {
                 if (buff_size % elem_size)
                         THROW_EXCEPTION << "buff_size="
                                 << buff_size
                                 << " must be a product of "
-                                << elem_size;
+                                << sizeof(T);
 
-                return buff_size / elem_size;
+                return std::max(round_down(buff_size / 2, sizeof(T)),
+                                sizeof(T));
+        }
+
+        /* the block stays valid until the next one is requested */
+        bool _next_block()
+        {
+                std::size_t size;
+                auto p = ra_.next_block(size);
+
+                cur_ = reinterpret_cast<const T*>(p);
+                end_ = cur_ + size / elem_size;
+                read_ += size;
+
+                /* the block is in memory, it isn't needed in the file */
+                punch_.consumed(read_);
+
+                _check_block();
+
+                return cur_ != end_;
+        }
+
+        void _check_block()
+        {
+                if (cur_ != end_)
+                        footer_.check(cur_, end_ - cur_);
+                else
+                        footer_.finish();
+        }
+
+        /* The copied tail is read back from the source, it's in the page
+         * cache after the copy: the values are verified against the source
+         * footer and summed up into the output one, so the output is only
+         * written by the kernel */
+        void _sum_copied(_chunk_ostream<T, chunk_stream_stdio>& os,
+                         uint64_t from)
+        {
+                if (!footer_.enabled() && !os.footer_.enabled())
+                        return;
+
+                std::vector<T> buff(std::min<uint64_t>(
+                        (file_size_ - from) / elem_size,
+                        1_MiB / elem_size));
+
+                while (from < file_size_)
+                {
+                        std::size_t size = std::min<uint64_t>(
+                                buff.size() * elem_size, file_size_ - from);
+
+                        ssize_t r = pread(fileno(is_.get()), buff.data(), size,
+                                          from);
+
+                        if (r <= 0 || r % elem_size)
+                                THROW_FILE_EXCEPTION(id().to_full_filename())
+                                        << "Cannot read the file";
+
+                        footer_.check(buff.data(), r / elem_size);
+                        os.footer_.add(buff.data(), r / elem_size);
+
+                        from += r;
+                }
+
+                footer_.finish();
         }
 private:
         chunk_id id_;
         size_t buff_size_ = 0;
-        size_t buff_elem_n_ = 0;
-        std::vector<T> buffer_;
-        FILE* is_ = nullptr;
-        T val_ = T();
+        /* a moved-in stream waits for the read in flight before the
+         * file is replaced */
+        read_ahead ra_;
+        std::unique_ptr<FILE, stdio_closer> is_;
+        const T* cur_ = nullptr;
+        const T* end_ = nullptr;
         uint64_t file_size_ = 0;
+        /* bytes handed to the consumer */
         uint64_t read_ = 0;
+
+        bool punch_holes_ = false;
+        hole_puncher punch_;
+
+        run_footer_reader<T> footer_;
+};
+
+template<typename T>
+class _chunk_istream<T, chunk_stream_uring>
+{
+        static_assert(PAGE_SIZE % sizeof(T) == 0,
+                      "T must fit a page without a remainder");
+public:
+        static constexpr size_t elem_size = sizeof(T);
+
+        _chunk_istream() = default;
+
+        explicit _chunk_istream(chunk_id id)
+                : id_(std::move(id))
+        {}
+
+        _chunk_istream(_chunk_istream&& o) = default;
+        _chunk_istream& operator=(_chunk_istream&& o) = default;
+
+        void open(size_t buff_size)
+        {
+                open(id().to_full_filename(), buff_size);
+        }
+
+        void open(std::string&& filename, size_t buff_size)
+        {
+                uint64_t size = footer_.open(filename, run_trailer::codec_raw,
+                                             (uint64_t)-1);
+
+                reader_.reset(new uring_reader(filename, buff_size,
+                                               CONFIG_URING_BUFFERS,
+                                               _use_direct_io, size));
+
+                if (reader_->size() % elem_size)
+                        THROW_FILE_EXCEPTION(filename) 
+                        << "File is broken, the size must be a product of "
+                                << elem_size;
+
+                taken_ = 0;
+
+                if (punch_holes_)
+                        punch_.open(filename, CONFIG_PUNCH_HOLES_STEP);
+
+                if (!_next_block())
+                        THROW_FILE_EXCEPTION(filename) 
+                        << "Can't read the file seems like it's empty";
+        }
+
+        const T& value() const { return *cur_; }
+
+        bool next()
+        {
+                if (++cur_ != end_)
+                        return true;
+
+                return _next_block();
+        }
+        bool eof() const { return cur_ == end_; }
+
+        void release() noexcept
+        {
+                reader_.reset();
+                punch_.close();
+                cur_ = end_ = nullptr;
+        }
+
+        /* the file is punched out as it's read, set before open() */
+        void punch_holes(bool enable) { punch_holes_ = enable; }
+
+        /* the values are verified against the run footer, set before
+         * open() */
+        void footer(bool enable) { footer_.enable(enable); }
+
+        void copy_to(_chunk_ostream<T, chunk_stream_uring>& os)
+        {
+                do
+                {
+                        os.write(cur_, end_ - cur_);
+                }
+                while (_next_block());
+        }
+
+        /* copies up to n elements from the current one on and moves past
+         * them, less than n only at the end */
+        std::size_t read(T* data, std::size_t n)
+        {
+                std::size_t done = 0;
+
+                while (done < n && cur_ != end_)
+                {
+                        std::size_t k = std::min<std::size_t>(n - done,
+                                                              end_ - cur_);
+
+                        mem_copy(data + done, cur_, k * sizeof(T));
+                        cur_ += k;
+                        done += k;
+
+                        if (cur_ == end_)
+                                _next_block();
+                }
+
+                return done;
+        }
+
+        chunk_id id() const { return id_; }
+
+        uint64_t size() const { return reader_ ? reader_->size() : 0; }
+        uint64_t count() const { return size() / elem_size; }
+
+        size_t buff_size() const { return reader_ ? reader_->buff_size() : 0; }
+
+        /* bytes read from the file so far */
+        uint64_t bytes_read() const { return taken_; }
+
+private:
+        /* the block stays valid until the next one is requested */
+        bool _next_block()
+        {
+                std::size_t size;
+                auto p = reader_->next_block(size);
+
+                cur_ = reinterpret_cast<const T*>(p);
+                end_ = cur_ + size / elem_size;
+
+                /* the block is in memory, it isn't needed in the file */
+                taken_ += size;
+                punch_.consumed(taken_);
+
+                _check_block();
+
+                return cur_ != end_;
+        }
+
+        void _check_block()
+        {
+                if (cur_ != end_)
+                        footer_.check(cur_, end_ - cur_);
+                else
+                        footer_.finish();
+        }
+private:
+        chunk_id id_;
+        std::unique_ptr<uring_reader> reader_;
+        const T* cur_ = nullptr;
+        const T* end_ = nullptr;
+
+        bool punch_holes_ = false;
+        hole_puncher punch_;
+        uint64_t taken_ = 0;
+
+        run_footer_reader<T> footer_;
 };
 
 template<typename T>
@@ -259,17 +655,15 @@ public:
         explicit _chunk_istream(mapped_range_uptr&& range, chunk_id id)
                 : range_(std::move(range)), id_(id)
         {
-                auto size = range_->size();
-
-                if (size % elem_size)
-                        THROW_EXCEPTION 
-                        << "Range is broken, the size must be a product of "
-                        << sizeof(T);
-
-                size_n_ = size / sizeof(T);
-                data_ = reinterpret_cast<const T*>(range_->data());
+                footer_.enable(false);
+                _init();
         }
 
+        /* the chunk is mapped from its file in CONFIG_CHUNK_DIRS on open */
+        explicit _chunk_istream(chunk_id id)
+                : id_(std::move(id))
+        {}
+
         ~_chunk_istream()
         {
                 if (range_)
@@ -279,9 +673,41 @@ public:
         _chunk_istream(_chunk_istream&& o) = default;
         _chunk_istream& operator=(_chunk_istream&& o) = default;
 
-	void open()
+	void open(size_t = 0)
 	{
+                if (!range_)
+                {
+                        /* the pages are punched out through the mapping */
+                        auto mode = punch_n_ ? std::ios::in | std::ios::out
+                                             : std::ios::in;
+
+                        auto filename = id_.to_full_filename();
+
+                        file_ = mapped_file::create();
+                        file_->open(filename.c_str(), mode);
+
+                        auto size = footer_.open(filename,
+                                                 run_trailer::codec_raw,
+                                                 file_->size());
+
+                        range_ = file_->range(0, size);
+                        _init();
+
+                        if (footer_.enabled())
+                        {
+                                _verify(cur_);
+                                index_ = footer_.index();
+                        }
+                }
+
                 range_->advise(madvice::sequential);
+
+                if (CONFIG_MERGE_MAP_POLICY & CONFIG_MAP_HUGEPAGE)
+                        range_->advise(madvice::hugepage);
+
+                if (window_n_)
+                        range_->advise(window_advice(), 0,
+                                       window_n_ * elem_size);
 	}
 
         const T& value() const { return data_[cur_]; }
@@ -289,25 +715,145 @@ public:
         bool next()
         {
                 ++cur_;
+
+                if (cur_ == pf_mark_)
+                        _prefetch();
+
+                if (check_order_ && cur_ < size_n_)
+                        _check_order();
+
                 return cur_ < size_n_;
                 
         }
         bool eof() const { return cur_ >= size_n_; }
 
+        /* the data from the current element to the end */
+        span<const T> remaining() const
+        {
+                return span<const T>(data_ + cur_, size_n_ - cur_);
+        }
+
+        /* the position of the cursor from the start of the run */
+        std::size_t position() const { return cur_; }
+
+        /* the fences of the run kept in place, the ones of a run file are
+         * read from its footer, may be filled after the stream is made */
+        void index(std::shared_ptr<const run_index<T>> index)
+        {
+                index_ = std::move(index);
+        }
+
+        /* null unless the index covers the whole run */
+        const run_index<T>* index() const
+        {
+                return index_ && index_->count() == size_n_ ? index_.get()
+                                                            : nullptr;
+        }
+
+        /* moves the cursor n elements forward, false if it reached the end,
+         * the data stays mapped until the next call */
+        bool skip(std::size_t n)
+        {
+                if (check_order_)
+                {
+                        auto end = data_ + std::min(cur_ + n + 1, size_n_);
+                        auto it = std::is_sorted_until(data_ + cur_, end);
+                        if (it != end)
+                        {
+                                cur_ = it - data_;
+                                _check_order();
+                        }
+                }
+
+                cur_ += n;
+
+                /* the skipped values are taken by the caller, they're
+                 * verified before they are used */
+                if (footer_.enabled() && cur_ >= verified_)
+                        _verify(cur_);
+
+                if (pf_mark_ != (std::size_t)-1)
+                {
+                        pf_mark_ = round_up(cur_ + 1, line_n);
+
+                        if (window_n_ && cur_ >= window_mark_)
+                                window_mark_ = cur_ / window_n_ * window_n_;
+                }
+
+                return cur_ < size_n_;
+        }
+
+        /* verify that the data is sorted while reading it,
+         * used for inputs that were sorted outside of us */
+        void check_order(bool enable) { check_order_ = enable; }
+
+        /* distance - bytes to prefetch into the cache ahead of the cursor,
+         * window - bytes to ask the kernel to read ahead (WILLNEED) or to
+         * fault in (POPULATE) one window before the cursor gets there,
+         * 0 disables either */
+        void prefetch(size_t distance, size_t window)
+        {
+                pf_dist_n_ = distance / elem_size;
+                window_n_ = round_up(window, PAGE_SIZE) / elem_size;
+                window_mark_ = 0;
+
+                if (pf_dist_n_ || window_n_ || punch_n_ || drop_n_
+                    || footer_.enabled())
+                        pf_mark_ = round_up(cur_ + 1, line_n);
+                else
+                        pf_mark_ = (std::size_t)-1;
+        }
+
+        /* the consumed part is punched out of the file, the range must be
+         * a shared writable mapping */
+        void punch_holes(bool enable)
+        {
+                punch_n_ = enable ? round_up(CONFIG_PUNCH_HOLES_STEP, PAGE_SIZE)
+                                    / elem_size
+                                  : 0;
+
+                if (punch_n_ && pf_mark_ == (std::size_t)-1)
+                        pf_mark_ = round_up(cur_ + 1, line_n);
+        }
+
+        /* the values are verified against the run footer a block ahead
+         * of the cursor, set before open() */
+        void footer(bool enable) { footer_.enable(enable); }
+
         void release()
         {
+                if (footer_.enabled() && cur_ >= size_n_)
+                        _verify(size_n_);
+
+                if (punch_n_)
+                        _punch(std::min(cur_, size_n_));
+
+                range_->advise_close(CONFIG_MERGE_MAP_POLICY);
 		range_->advise(madvice::dontneed);
                 range_.reset();
+                file_.reset();
         }
 
-        void copy_to(_chunk_ostream<T, chunk_stream_mmap>& os)
+        /* any output which takes the data in blocks */
+        template<typename OStream>
+        void copy_to(OStream& os)
         {
-                do
+                if (check_order_)
                 {
-                        auto val = data_[cur_];
-                        os.put(val);
-                } 
-                while (next());
+                        auto end = data_ + size_n_;
+                        auto it = std::is_sorted_until(data_ + cur_, end);
+                        if (it != end)
+                        {
+                                cur_ = it - data_;
+                                _check_order();
+                        }
+                }
+
+                if (footer_.enabled())
+                        _verify(size_n_);
+
+                os.write(data_ + cur_, size_n_ - cur_);
+                cur_ = size_n_;
         }
 
         uint64_t size() const { return size_n_ * sizeof(T); }
@@ -315,6 +861,12 @@ public:
 
         size_t buff_size() const { return 4096; }
 
+        /* bytes the cursor went through */
+        uint64_t bytes_read() const
+        {
+                return std::min(cur_, size_n_) * elem_size;
+        }
+
         chunk_id id() const { return id_; }
 private:
         static constexpr size_t get_buff_elem_n(size_t buff_size)
@@ -328,12 +880,282 @@ private:
 
                 return buff_size / elem_size;
         }
+
+        void _init()
+        {
+                auto size = range_->size();
+
+                if (size % elem_size)
+                        THROW_EXCEPTION 
+                        << "Range is broken, the size must be a product of "
+                        << sizeof(T);
+
+                size_n_ = size / sizeof(T);
+                data_ = reinterpret_cast<const T*>(range_->data());
+
+                drop_n_ = round_up(CONFIG_MERGE_DROP_BEHIND, PAGE_SIZE)
+                        / elem_size;
+
+                prefetch(CONFIG_MERGE_PREFETCH_DISTANCE,
+                         CONFIG_MERGE_MAP_POLICY
+                         & (CONFIG_MAP_WILLNEED | CONFIG_MAP_POPULATE)
+                                ? CONFIG_MERGE_WILLNEED_WINDOW : 0);
+        }
+
+        static constexpr madvice window_advice()
+        {
+                return CONFIG_MERGE_MAP_POLICY & CONFIG_MAP_POPULATE
+                        ? madvice::populate_read : madvice::willneed;
+        }
+
+        /* called once per cache line of the input */
+        void _prefetch()
+        {
+                pf_mark_ += line_n;
+
+                if (pf_dist_n_ && cur_ + pf_dist_n_ < size_n_)
+                        __builtin_prefetch(data_ + cur_ + pf_dist_n_);
+
+                if (window_n_ && cur_ >= window_mark_)
+                {
+                        window_mark_ += window_n_;
+
+                        range_->advise(window_advice(),
+                                       window_mark_ * elem_size,
+                                       window_n_ * elem_size);
+                }
+
+                if (punch_n_ && cur_ >= punched_ + punch_n_)
+                        _punch(round_down(cur_, punch_n_));
+                else if (drop_n_ && cur_ >= dropped_ + drop_n_)
+                        _drop(round_down(cur_, drop_n_));
+
+                if (footer_.enabled() && cur_ >= verified_)
+                        _verify(cur_);
+        }
+
+        /* verifies the blocks up to the end of the one with pos */
+        void _verify(std::size_t pos)
+        {
+                std::size_t end = std::min<std::size_t>(
+                        round_down(pos, run_block_n) + run_block_n, size_n_);
+
+                if (end > verified_)
+                        footer_.check(data_ + verified_, end - verified_);
+
+                if (verified_ < size_n_ && end == size_n_)
+                        footer_.finish();
+
+                verified_ = end;
+        }
+
+        /* the pages are reclaimed first, or at once with CONFIG_MAP_PAGEOUT
+         * which writes the dirty ones back */
+        void _drop(std::size_t end)
+        {
+                range_->advise(CONFIG_MERGE_MAP_POLICY & CONFIG_MAP_PAGEOUT
+                                       ? madvice::pageout : madvice::cold,
+                               dropped_ * elem_size,
+                               (end - dropped_) * elem_size);
+                range_->advise(madvice::dontneed, dropped_ * elem_size,
+                               (end - dropped_) * elem_size);
+                dropped_ = end;
+        }
+
+        void _punch(std::size_t end)
+        {
+                if (end <= punched_)
+                        return;
+
+                range_->advise(madvice::remove, punched_ * elem_size,
+                               (end - punched_) * elem_size);
+                punched_ = end;
+        }
+
+        void _check_order() const
+        {
+                if (data_[cur_] < data_[cur_ - 1])
+                        THROW_EXCEPTION << "Chunk " << id_
+                                        << " is not sorted at element "
+                                        << cur_ << " ("
+                                        << data_[cur_ - 1] << " > "
+                                        << data_[cur_] << ")";
+        }
 private:
+        mapped_file_uptr file_;
         mapped_range_uptr range_;
         chunk_id id_;
 
         const T* data_ = nullptr;
         std::size_t size_n_ = 0, cur_ = 0;
+        bool check_order_ = false;
+
+        /* elements in a cache line */
+        static constexpr std::size_t line_n = STREAM_LINE_SIZE / elem_size;
+
+        std::size_t pf_dist_n_ = 0, pf_mark_ = (std::size_t)-1;
+        std::size_t window_n_ = 0, window_mark_ = 0;
+        std::size_t punch_n_ = 0, punched_ = 0;
+        std::size_t drop_n_ = 0, dropped_ = 0;
+
+        run_footer_reader<T> footer_;
+        std::size_t verified_ = 0;
+
+        std::shared_ptr<const run_index<T>> index_;
+};
+
+
+/* Decodes a run written by the packed ostream: a u64 count of the values
+ * followed by the run_codec frames, read through a byte stream of the
+ * Base kind */
+template<typename T, typename Base>
+class _chunk_istream<T, chunk_stream_packed<Base>>
+{
+        using codec = run_codec<T>;
+public:
+        static constexpr size_t elem_size = sizeof(T);
+
+        _chunk_istream() = default;
+
+        explicit _chunk_istream(chunk_id id)
+                : id_(std::move(id))
+        {}
+
+        _chunk_istream(_chunk_istream&& o) = default;
+        _chunk_istream& operator=(_chunk_istream&& o) = default;
+
+        void open(size_t buff_size)
+        {
+                open(id().to_full_filename(), buff_size);
+        }
+
+        void open(std::string&& filename, size_t buff_size)
+        {
+                /* the footer describes the values, they're verified as
+                 * they're decoded */
+                footer_.open(filename, run_trailer::codec_packed, 0);
+
+                is_.footer(false);
+                is_.open(std::string(filename), buff_size);
+                frame_.reset(new T[codec::frame_n]);
+                buffer_.reset(new char[codec::max_frame_size
+                                       + codec::padding]);
+
+                uint64_t count = 0;
+
+                if (is_.read(reinterpret_cast<uint8_t*>(&count),
+                             sizeof(count)) != sizeof(count))
+                        THROW_FILE_EXCEPTION(filename)
+                                << "File is broken, no header";
+
+                count_ = left_ = count;
+
+                if (!_next_frame())
+                        THROW_FILE_EXCEPTION(filename)
+                        << "Can't read the file seems like it's empty";
+        }
+
+        const T& value() const { return *cur_; }
+
+        bool next()
+        {
+                if (++cur_ != end_)
+                        return true;
+
+                return _next_frame();
+        }
+        bool eof() const { return cur_ == end_; }
+
+        void release() noexcept
+        {
+                is_.release();
+                cur_ = end_ = nullptr;
+        }
+
+        /* set before open() */
+        void punch_holes(bool enable) { is_.punch_holes(enable); }
+
+        /* set before open() */
+        void footer(bool enable) { footer_.enable(enable); }
+
+        template<typename OStream>
+        void copy_to(OStream& os)
+        {
+                do
+                {
+                        os.write(cur_, end_ - cur_);
+                }
+                while (_next_frame());
+        }
+
+        chunk_id id() const { return id_; }
+
+        /* the decoded run */
+        uint64_t size() const { return count_ * elem_size; }
+        uint64_t count() const { return count_; }
+
+        size_t buff_size() const { return is_.buff_size(); }
+
+        /* bytes of the encoded run read so far */
+        uint64_t bytes_read() const { return is_.bytes_read(); }
+
+private:
+        bool _next_frame()
+        {
+                cur_ = end_ = frame_.get();
+
+                if (left_ == 0)
+                        return false;
+
+                char* frame = buffer_.get();
+                auto data = reinterpret_cast<uint8_t*>(frame);
+
+                if (is_.read(data, codec::head_size) != codec::head_size)
+                        THROW_FILE_EXCEPTION(id_.to_full_filename())
+                                << "File is broken, " << left_
+                                << " values are missing";
+
+                if (!codec::valid_head(frame))
+                        THROW_FILE_EXCEPTION(id_.to_full_filename())
+                                << "File is broken, wrong frame head "
+                                << (unsigned)data[0] << "/"
+                                << (unsigned)data[1];
+
+                std::size_t size = codec::frame_size(frame)
+                                 - codec::head_size;
+
+                if (is_.read(data + codec::head_size, size) != size)
+                        THROW_FILE_EXCEPTION(id_.to_full_filename())
+                                << "File is broken, the frame is cut off";
+
+                std::size_t n = codec::decode(frame, frame_.get());
+
+                if (n == 0 || n > left_)
+                        THROW_FILE_EXCEPTION(id_.to_full_filename())
+                                << "File is broken, wrong frame of " << n;
+
+                left_ -= n;
+                end_ += n;
+
+                footer_.check(cur_, n);
+
+                if (left_ == 0)
+                        footer_.finish();
+
+                return true;
+        }
+private:
+        chunk_id id_;
+        _chunk_istream<uint8_t, Base> is_;
+
+        std::unique_ptr<T[]> frame_;
+        std::unique_ptr<char[]> buffer_;
+        const T* cur_ = nullptr;
+        const T* end_ = nullptr;
+
+        uint64_t count_ = 0, left_ = 0;
+
+        run_footer_reader<T> footer_;
 };
 
 
@@ -343,23 +1165,24 @@ bool operator>(const chunk_istream<T>& a, const chunk_istream<T>& b)
         return a.value() > b.value();
 }
 
-template<typename T>
+template<typename T, typename StreamType = chunk_stream_type>
 class chunk_istream_iterator
         : public std::iterator<std::input_iterator_tag, T, 
                                ptrdiff_t, const T*, const T&>
 {
 public:
-        
+        using istream_type = _chunk_istream<T, StreamType>;
+
         explicit
-                chunk_istream_iterator(chunk_istream<T>& p)
+                chunk_istream_iterator(istream_type& p)
         {
                 if (p.eof())
-                        p_ = (chunk_istream<T>*)(uintptr_t) - 1;
+                        p_ = (istream_type*)(uintptr_t) - 1;
                 else
                         p_ = &p;
         }
         chunk_istream_iterator()
-                : p_((chunk_istream<T>*)(uintptr_t) - 1)
+                : p_((istream_type*)(uintptr_t) - 1)
         {
         }
 
@@ -386,11 +1209,11 @@ public:
         {
                 if (!p_->next())
                 {
-                        p_ = (chunk_istream<T>*)(uintptr_t) - 1;
+                        p_ = (istream_type*)(uintptr_t) - 1;
                 }
 
                 return *this;
         }
 private:
-        chunk_istream<T>* p_;
+        istream_type* p_;
 };
@@ -1,11 +1,20 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 #include "../tools/exception.hpp"
+#include "../tools/io_worker.hpp"
 #include "../tools/mapped_file.hpp"
+#include "../tools/stream_writer.hpp"
+#include "../tools/util.hpp"
+#include "../tools/uring.hpp"
 #include "chunk_stream.hpp"
+#include "run_codec.hpp"
+#include "run_footer.hpp"
 
 
+/* The full buffers are written by the shared I/O worker while the merge
+ * fills the other one */
 template<typename T>
 class _chunk_ostream<T, chunk_stream_cpp>
 {
@@ -17,9 +26,16 @@ public:
 
         {}
 
+        /* the errors are reported by an explicit close() */
         ~_chunk_ostream()
         {
-                close();
+                try
+                {
+                        close();
+                }
+                catch (...)
+                {
+                }
         }
 
         _chunk_ostream(_chunk_ostream&&) = default;
@@ -28,42 +44,124 @@ public:
         void open(size_t buff_size, uint64_t)
         {
                 buff_size_ = buff_size;
-                buff_.resize(buff_size);
 
-                os_.open(filename_, std::ios::out | std::ios::trunc
-                        | std::ios::binary);
+                os_.reset(new std::ofstream);
 
-                if (!os_)
+                /* the blocks are written straight from our buffers */
+                os_->rdbuf()->pubsetbuf(nullptr, 0);
+                os_->open(filename_, std::ios::out | std::ios::trunc
+                          | std::ios::binary);
+
+                if (!*os_)
                         THROW_FILE_EXCEPTION(filename_) << "Cannot open the file";
 
-                os_.rdbuf()->pubsetbuf(&buff_[0], buff_size);
+                auto os = os_.get();
+                auto filename = filename_;
+
+                wb_.open(get_block_size(buff_size),
+                [os, filename](const char* data, std::size_t size)
+                {
+                        if (!os->write(data, size))
+                                THROW_FILE_EXCEPTION(filename)
+                                        << "Cannot write the file";
+                });
+
+                _set_block(wb_.block());
         }
 
         void put(T v)
         {
-                os_.write((char*)&v, sizeof(T));
+                *cur_++ = v;
+
+                if (cur_ == end_)
+                        _commit();
+        }
+
+        void write(const T* data, std::size_t n)
+        {
+                while (n)
+                {
+                        std::size_t k = std::min<std::size_t>(n, end_ - cur_);
+
+                        mem_copy(cur_, data, k * sizeof(T));
+                        cur_ += k;
+                        data += k;
+                        n -= k;
+
+                        if (cur_ == end_)
+                                _commit();
+                }
         }
 
-        void close() noexcept
+        void close()
         {
-                os_ = decltype(os_)();
-                buff_ = std::vector<char>();
+                if (!os_)
+                        return;
+
+                auto os = std::move(os_);
+
+                footer_.add(begin_, cur_ - begin_);
+                bytes_written_ += (cur_ - begin_) * sizeof(T);
+                wb_.commit((cur_ - begin_) * sizeof(T));
+                wb_.flush();
+
+                begin_ = cur_ = end_ = nullptr;
+
+                os->close();
+
+                if (!*os)
+                        THROW_FILE_EXCEPTION(filename_)
+                                << "Cannot write the file";
+
+                footer_.write(filename_);
         }
 
         size_t buff_size() const { return buff_size_; }
 
+        /* bytes written to the file so far */
+        uint64_t bytes_written() const { return bytes_written_; }
+
         void filename(const std::string& value) { filename_ = value; }
         std::string filename() const { return filename_; }
+
+        /* the run footer is written on close, the default for the runs */
+        void footer(bool enable) { footer_.enable(enable); }
 private:
-        friend class _chunk_istream<T, chunk_stream_cpp>;
+        static size_t get_block_size(size_t buff_size)
+        {
+                return std::max(round_down(buff_size / 2, sizeof(T)),
+                                sizeof(T));
+        }
+
+        void _commit()
+        {
+                footer_.add(begin_, cur_ - begin_);
+                bytes_written_ += (cur_ - begin_) * sizeof(T);
+                _set_block(wb_.commit((cur_ - begin_) * sizeof(T)));
+        }
 
+        void _set_block(char* block)
+        {
+                begin_ = cur_ = reinterpret_cast<T*>(block);
+                end_ = begin_ + wb_.block_size() / sizeof(T);
+        }
 private:
-        std::vector<char> buff_;
-        std::ofstream os_;
+        /* a moved-in stream waits for the write in flight before the
+         * file is replaced */
+        write_behind wb_;
+        std::unique_ptr<std::ofstream> os_;
         std::string filename_;
         size_t buff_size_ = 0;
+        run_footer_writer<T> footer_;
+
+        T* begin_ = nullptr;
+        T* cur_ = nullptr;
+        T* end_ = nullptr;
+
+        uint64_t bytes_written_ = 0;
 };
 
+/* Same write-behind as the C++ streams */
 template<typename T>
 class _chunk_ostream<T, chunk_stream_stdio>
 {
@@ -75,9 +173,16 @@ public:
 
         {}
 
+        /* the errors are reported by an explicit close() */
         ~_chunk_ostream()
         {
-                close();
+                try
+                {
+                        close();
+                }
+                catch (...)
+                {
+                }
         }
 
         _chunk_ostream(_chunk_ostream&&) = default;
@@ -86,95 +191,862 @@ public:
         void open(size_t buff_size, uint64_t)
         {
                 buff_size_ = buff_size;
-                buff_.resize(buff_size);
 
-
-                os_ = fopen(filename_.c_str(), "wb");
+                os_.reset(fopen(filename_.c_str(), "wb"));
                 if (!os_)
                         THROW_FILE_EXCEPTION(filename_) << "Cannot open the file";
 
-                setvbuf(os_, &buff_[0], _IOFBF, buff_size);
+                setvbuf(os_.get(), nullptr, _IONBF, 0);
+
+                auto os = os_.get();
+                auto filename = filename_;
+
+                wb_.open(get_block_size(buff_size),
+                [os, filename](const char* data, std::size_t size)
+                {
+                        if (fwrite(data, 1, size, os) != size)
+                                THROW_FILE_EXCEPTION(filename)
+                                        << "Cannot write the file";
+                });
+
+                _set_block(wb_.block());
         }
 
         void put(T v)
         {
-                fwrite((char*)&v, sizeof(T), 1, os_);
+                *cur_++ = v;
+
+                if (cur_ == end_)
+                        _commit();
+        }
+
+        void write(const T* data, std::size_t n)
+        {
+                while (n)
+                {
+                        std::size_t k = std::min<std::size_t>(n, end_ - cur_);
+
+                        mem_copy(cur_, data, k * sizeof(T));
+                        cur_ += k;
+                        data += k;
+                        n -= k;
+
+                        if (cur_ == end_)
+                                _commit();
+                }
         }
 
-        void close() noexcept
+        void close()
         {
-                if (os_)
+                if (!os_)
+                        return;
+
+                FILE* os = os_.release();
+
+                try
+                {
+                        footer_.add(begin_, cur_ - begin_);
+                        bytes_written_ += (cur_ - begin_) * sizeof(T);
+                        wb_.commit((cur_ - begin_) * sizeof(T));
+                        wb_.flush();
+                }
+                catch (...)
                 {
-                        fclose(os_);
-                        os_ = nullptr;
+                        fclose(os);
+                        throw;
                 }
 
-                buff_ = std::vector<char>();
+                begin_ = cur_ = end_ = nullptr;
+
+                if (fclose(os) != 0)
+                        THROW_FILE_EXCEPTION(filename_)
+                                << "Cannot write the file";
+
+                footer_.write(filename_);
         }
 
         size_t buff_size() const { return buff_size_; }
 
+        /* bytes written to the file so far */
+        uint64_t bytes_written() const { return bytes_written_; }
+
         void filename(const std::string& value) { filename_ = value; }
         std::string filename() const { return filename_; }
+
+        /* the run footer is written on close, the default for the runs */
+        void footer(bool enable) { footer_.enable(enable); }
 private:
         friend class _chunk_istream<T, chunk_stream_stdio>;
 
+        static size_t get_block_size(size_t buff_size)
+        {
+                return std::max(round_down(buff_size / 2, sizeof(T)),
+                                sizeof(T));
+        }
+
+        /* everything put so far reaches the file */
+        void flush()
+        {
+                _commit();
+                wb_.flush();
+        }
+
+        void _commit()
+        {
+                footer_.add(begin_, cur_ - begin_);
+                bytes_written_ += (cur_ - begin_) * sizeof(T);
+                _set_block(wb_.commit((cur_ - begin_) * sizeof(T)));
+        }
+
+        void _set_block(char* block)
+        {
+                begin_ = cur_ = reinterpret_cast<T*>(block);
+                end_ = begin_ + wb_.block_size() / sizeof(T);
+        }
 private:
-        std::vector<char> buff_;
-        FILE* os_ = nullptr;
+        /* a moved-in stream waits for the write in flight before the
+         * file is replaced */
+        write_behind wb_;
+        std::unique_ptr<FILE, stdio_closer> os_;
         std::string filename_;
         size_t buff_size_ = 0;
+        run_footer_writer<T> footer_;
+
+        T* begin_ = nullptr;
+        T* cur_ = nullptr;
+        T* end_ = nullptr;
+
+        uint64_t bytes_written_ = 0;
+};
+
+template<typename T>
+class _chunk_ostream<T, chunk_stream_uring>
+{
+        static_assert(PAGE_SIZE % sizeof(T) == 0,
+                      "T must fit a page without a remainder");
+public:
+        _chunk_ostream() = default;
+
+        explicit _chunk_ostream(std::string&& filename)
+                : filename_(std::move(filename))
+        {}
+
+        /* the errors are reported by an explicit close() */
+        ~_chunk_ostream()
+        {
+                try
+                {
+                        close();
+                }
+                catch (...)
+                {
+                }
+        }
+
+        _chunk_ostream(_chunk_ostream&&) = default;
+        _chunk_ostream& operator=(_chunk_ostream&&) = default;
+
+        void open(size_t buff_size, uint64_t)
+        {
+                writer_.reset(new uring_writer(filename_, buff_size,
+                                               CONFIG_URING_BUFFERS,
+                                               _use_direct_io));
+                buff_size_ = writer_->buff_size();
+
+                _set_block(writer_->block());
+        }
+
+        void put(T v)
+        {
+                *cur_++ = v;
+
+                if (cur_ == end_)
+                        _commit();
+        }
+
+        void write(const T* data, std::size_t n)
+        {
+                while (n)
+                {
+                        std::size_t k = std::min<std::size_t>(n, end_ - cur_);
+
+                        mem_copy(cur_, data, k * sizeof(T));
+                        cur_ += k;
+                        data += k;
+                        n -= k;
+
+                        if (cur_ == end_)
+                                _commit();
+                }
+        }
+
+        void close()
+        {
+                if (!writer_)
+                        return;
+
+                auto writer = std::move(writer_);
+
+                footer_.add(begin_, cur_ - begin_);
+                bytes_written_ += (cur_ - begin_) * sizeof(T);
+                writer->commit((cur_ - begin_) * sizeof(T));
+                writer->close();
+
+                begin_ = cur_ = end_ = nullptr;
+
+                footer_.write(filename_);
+        }
+
+        size_t buff_size() const { return buff_size_; }
+
+        /* bytes written to the file so far */
+        uint64_t bytes_written() const { return bytes_written_; }
+
+        void filename(const std::string& value) { filename_ = value; }
+        std::string filename() const { return filename_; }
+
+        /* the run footer is written on close, the default for the runs */
+        void footer(bool enable) { footer_.enable(enable); }
+private:
+        void _commit()
+        {
+                footer_.add(begin_, cur_ - begin_);
+                bytes_written_ += (cur_ - begin_) * sizeof(T);
+                _set_block(writer_->commit((cur_ - begin_) * sizeof(T)));
+        }
+
+        void _set_block(char* block)
+        {
+                begin_ = cur_ = reinterpret_cast<T*>(block);
+                end_ = begin_ + writer_->block_size() / sizeof(T);
+        }
+private:
+        std::unique_ptr<uring_writer> writer_;
+        std::string filename_;
+        size_t buff_size_ = 0;
+        run_footer_writer<T> footer_;
+
+        T* begin_ = nullptr;
+        T* cur_ = nullptr;
+        T* end_ = nullptr;
+
+        uint64_t bytes_written_ = 0;
+};
+
+/* Streams the result to a descriptor which doesn't have to be a file */
+template<typename T>
+class _chunk_ostream<T, chunk_stream_fd>
+{
+        static_assert(PAGE_SIZE % sizeof(T) == 0,
+                      "T must fit a page without a remainder");
+public:
+        _chunk_ostream() = default;
+
+        explicit _chunk_ostream(int fd)
+                : fd_(fd)
+        {}
+
+        /* the errors are reported by an explicit close() */
+        ~_chunk_ostream()
+        {
+                try
+                {
+                        close();
+                }
+                catch (...)
+                {
+                }
+        }
+
+        _chunk_ostream(_chunk_ostream&&) = default;
+        _chunk_ostream& operator=(_chunk_ostream&&) = default;
+
+        void open(size_t buff_size, uint64_t)
+        {
+                writer_.reset(new stream_writer(fd_, buff_size));
+
+                _set_block(writer_->block());
+        }
+
+        void put(T v)
+        {
+                *cur_++ = v;
+
+                if (cur_ == end_)
+                        _commit();
+        }
+
+        void write(const T* data, std::size_t n)
+        {
+                while (n)
+                {
+                        std::size_t k = std::min<std::size_t>(n, end_ - cur_);
+
+                        mem_copy(cur_, data, k * sizeof(T));
+                        cur_ += k;
+                        data += k;
+                        n -= k;
+
+                        if (cur_ == end_)
+                                _commit();
+                }
+        }
+
+        void close()
+        {
+                if (!writer_)
+                        return;
+
+                auto writer = std::move(writer_);
+
+                bytes_written_ += (cur_ - begin_) * sizeof(T);
+                writer->commit((cur_ - begin_) * sizeof(T));
+
+                begin_ = cur_ = end_ = nullptr;
+        }
+
+        size_t buff_size() const { return writer_ ? writer_->buff_size() : 0; }
+
+        /* bytes written to the file so far */
+        uint64_t bytes_written() const { return bytes_written_; }
+
+        std::string filename() const { return "fd " + std::to_string(fd_); }
+private:
+        void _commit()
+        {
+                bytes_written_ += (cur_ - begin_) * sizeof(T);
+                _set_block(writer_->commit((cur_ - begin_) * sizeof(T)));
+        }
+
+        void _set_block(char* block)
+        {
+                begin_ = cur_ = reinterpret_cast<T*>(block);
+                end_ = begin_ + writer_->block_size() / sizeof(T);
+        }
+private:
+        int fd_ = -1;
+        std::unique_ptr<stream_writer> writer_;
+
+        T* begin_ = nullptr;
+        T* cur_ = nullptr;
+        T* end_ = nullptr;
+
+        uint64_t bytes_written_ = 0;
 };
 
 template<typename T>
 class _chunk_ostream<T, chunk_stream_mmap>
 {
+        /* elements in the write-combining line */
+        static constexpr std::size_t line_n = STREAM_LINE_SIZE / sizeof(T);
+
+        static_assert(STREAM_LINE_SIZE % sizeof(T) == 0,
+                      "T must fit a stream line without a remainder");
 public:
         _chunk_ostream() = default;
 
         explicit _chunk_ostream(mapped_file_uptr&& output_file)
                 : file_(std::move(output_file))
         {
-                range_ = file_->range();
-                range_->advise(madvice::sequential);
+                footer_.enable(false);
+                _init(file_->range());
+        }
 
-                data_ = reinterpret_cast<T*>(range_->data());
+        /* writes to the range of a file mapped by someone else */
+        explicit _chunk_ostream(mapped_range_uptr&& range)
+        {
+                footer_.enable(false);
+                _init(std::move(range));
         }
 
+        /* the file is created and mapped on open, it's a run */
+        explicit _chunk_ostream(std::string&& filename)
+                : filename_(std::move(filename))
+        {}
+
+        /* the errors are reported by an explicit close() */
         ~_chunk_ostream()
         {
-                close();
+                try
+                {
+                        close();
+                }
+                catch (...)
+                {
+                }
         }
 
         _chunk_ostream(_chunk_ostream&&) = default;
         _chunk_ostream& operator=(_chunk_ostream&&) = default;
 
+        void open(size_t, uint64_t size)
+        {
+                if (range_)
+                        return;
+
+                file_ = mapped_file::create();
+
+                if (IS_ENABLED(CONFIG_PUNCH_HOLES))
+                        file_->open_sparse(filename_.c_str(), size,
+                                           std::ios::out | std::ios::trunc);
+                else
+                        file_->open(filename_.c_str(), size,
+                                    std::ios::out | std::ios::trunc);
+
+                _init(file_->range());
+        }
 
         void put(T v)
         {
-                data_[cur_++] = v;
+                footer_.add(v);
+
+                if (!nt_store_)
+                {
+                        _reserve(1);
+                        data_[cur_++] = v;
+                        return;
+                }
+
+                line_[line_pos_++] = v;
+
+                if (line_pos_ == line_cap_)
+                        _flush_line();
         }
 
-        void close() noexcept
+        void write(const T* data, std::size_t n)
         {
+                footer_.add(data, n);
+                _reserve(line_pos_ + n);
+
+                if (!nt_store_)
+                {
+                        mem_copy(data_ + cur_, data, n * sizeof(T));
+                        cur_ += n;
+                        return;
+                }
+
+                /* fill up the current line, then stream the whole lines
+                 * directly and stage what's left */
+                std::size_t head = std::min(n, line_cap_ - line_pos_);
+                mem_copy(&line_[line_pos_], data, head * sizeof(T));
+                line_pos_ += head;
+
+                if (line_pos_ != line_cap_)
+                        return;
+
+                _flush_line();
+
+                data += head;
+                n -= head;
+
+                std::size_t body = n - n % line_n;
+                mem_stream_copy(data_ + cur_, data, body * sizeof(T));
+                cur_ += body;
+
+                mem_copy(&line_[0], data + body, (n - body) * sizeof(T));
+                line_pos_ = n - body;
+        }
+
+        /* switches non-temporal stores on or off, can be done at any
+         * point, the staged data is flushed first */
+        void nt_store(bool enable)
+        {
+                if (range_ && line_pos_)
+                        _flush_line();
+
+                nt_store_ = enable;
+
+                _align_line();
+        }
+
+        /* the range is written back to the file as it's filled, offset -
+         * where the range starts in the file, the file must outlive the
+         * stream */
+        void writeback(mapped_file* file, uint64_t offset)
+        {
+                wb_file_ = file;
+                wb_offset_ = offset;
+                wb_n_ = file && CONFIG_OUTPUT_WRITEBACK_STEP
+                        ? round_up(CONFIG_OUTPUT_WRITEBACK_STEP, PAGE_SIZE)
+                          / sizeof(T)
+                        : 0;
+                wb_begin_ = wb_end_ = cur_;
+                wb_mark_ = wb_n_ ? cur_ + wb_n_ : size_n_;
+
+                mark_ = std::min({ alloc_mark_, populate_mark_, wb_mark_ });
+        }
+
+        void close()
+        {
+                bool opened = range_ != nullptr;
+
+                if (range_)
+                {
+                        if (line_pos_)
+                                _flush_line();
+
+                        if (nt_store_)
+                                store_fence();
+
+                        /* the tail is only started, the kernel writes it
+                         * anyway if that fails */
+                        if (wb_n_)
+                        {
+                                try { _writeback(cur_); }
+                                catch (...) {}
+                        }
+
+                        range_->advise_close(CONFIG_MERGE_MAP_POLICY);
+                }
+
                 range_.reset();
                 file_.reset();
+
+                /* the file was sized for the data, the footer extends it */
+                if (opened)
+                        footer_.write(filename_);
         }
 
         size_t buff_size() const { return 4096; }
+
+        /* bytes written to the mapping so far */
+        uint64_t bytes_written() const
+        {
+                return (cur_ + line_pos_) * sizeof(T);
+        }
+
+        void filename(const std::string& value) { filename_ = value; }
+        std::string filename() const { return filename_; }
+
+        /* the run footer is written on close, the default for the runs */
+        void footer(bool enable) { footer_.enable(enable); }
+
+        /* the fences of the run are built into index as it's written,
+         * the footer gets them anyway */
+        void index(std::shared_ptr<run_index<T>> index)
+        {
+                footer_.index(std::move(index));
+        }
 private:
-        friend class _chunk_istream<T, chunk_stream_stdio>;
+        void _init(mapped_range_uptr&& range)
+        {
+                range_ = std::move(range);
+                range_->advise(madvice::sequential);
+
+                if (CONFIG_MERGE_MAP_POLICY & CONFIG_MAP_HUGEPAGE)
+                        range_->advise(madvice::hugepage);
+
+                data_ = reinterpret_cast<T*>(range_->data());
+                size_n_ = range_->size() / sizeof(T);
+                cur_ = 0;
+
+                /* only a file of our own may be sparse */
+                alloc_n_ = file_ && IS_ENABLED(CONFIG_PUNCH_HOLES)
+                        ? round_up(CONFIG_PUNCH_HOLES_STEP, PAGE_SIZE)
+                          / sizeof(T)
+                        : 0;
+                alloc_mark_ = alloc_n_ ? 0 : size_n_;
+
+                populate_n_ = CONFIG_MERGE_MAP_POLICY & CONFIG_MAP_POPULATE
+                        ? round_up(CONFIG_MERGE_WILLNEED_WINDOW, PAGE_SIZE)
+                          / sizeof(T)
+                        : 0;
+                populate_mark_ = populate_n_ ? 0 : size_n_;
+
+                mark_ = std::min(alloc_mark_, populate_mark_);
+
+                nt_store(IS_ENABLED(CONFIG_OUTPUT_NT_STORE));
+
+                writeback(file_.get(), 0);
+        }
+
+        /* the disk space is allocated a step ahead of the writes, so
+         * running out of it is an error rather than SIGBUS, then the pages
+         * are faulted in a window ahead of them */
+        void _reserve(std::size_t n)
+        {
+                if (cur_ + n > mark_)
+                        _advance(cur_ + n);
+        }
+
+        void _advance(std::size_t end)
+        {
+                if (end > alloc_mark_)
+                {
+                        std::size_t mark = std::min(round_up(end, alloc_n_),
+                                                    size_n_);
+
+                        file_->allocate(alloc_mark_ * sizeof(T),
+                                        (mark - alloc_mark_) * sizeof(T));
+                        alloc_mark_ = mark;
+                }
+
+                if (end > populate_mark_)
+                {
+                        std::size_t mark = std::min(round_up(end, populate_n_),
+                                                    alloc_mark_);
+
+                        range_->advise(madvice::populate_write,
+                                       populate_mark_ * sizeof(T),
+                                       (mark - populate_mark_) * sizeof(T));
+                        populate_mark_ = mark;
+                }
+
+                if (end > wb_mark_)
+                        _writeback(cur_);
+
+                mark_ = std::min({ alloc_mark_, populate_mark_, wb_mark_ });
+        }
+
+        /* starts the writeback of what's written since the last time and
+         * waits for the step before */
+        void _writeback(std::size_t end)
+        {
+                if (end <= wb_end_)
+                        return;
+
+                /* the streamed lines must reach the page cache first */
+                if (nt_store_)
+                        store_fence();
+
+                wb_file_->writeback(wb_offset_ + wb_end_ * sizeof(T),
+                                    (end - wb_end_) * sizeof(T), false);
+
+                if (IS_ENABLED(CONFIG_OUTPUT_WRITEBACK_WAIT)
+                    && wb_end_ > wb_begin_)
+                        wb_file_->writeback(
+                                wb_offset_ + wb_begin_ * sizeof(T),
+                                (wb_end_ - wb_begin_) * sizeof(T), true);
+
+                wb_begin_ = wb_end_;
+                wb_end_ = end;
+                wb_mark_ = end + wb_n_;
+        }
+
+        /* the first line is shortened so the rest of them are aligned to
+         * the cache line in the output */
+        void _align_line()
+        {
+                auto addr = reinterpret_cast<uintptr_t>(data_ + cur_);
+                auto misalign = (addr % STREAM_LINE_SIZE) / sizeof(T);
+
+                line_cap_ = misalign ? line_n - misalign : line_n;
+        }
+
+        void _flush_line()
+        {
+                _reserve(line_pos_);
+
+                if (line_pos_ == line_n)
+                        mem_stream_copy(data_ + cur_, &line_[0],
+                                        STREAM_LINE_SIZE);
+                else
+                        mem_copy(data_ + cur_, &line_[0],
+                                 line_pos_ * sizeof(T));
+
+                cur_ += line_pos_;
+                line_pos_ = 0;
+                line_cap_ = line_n;
+        }
 
 private:
         chunk_id id_;
 
         mapped_file_uptr file_;
         mapped_range_uptr range_;
+        std::string filename_;
 
         T* data_ = nullptr;
         std::size_t size_n_ = 0, cur_ = 0;
+        std::size_t alloc_n_ = 0, alloc_mark_ = 0;
+        std::size_t populate_n_ = 0, populate_mark_ = 0;
+        std::size_t mark_ = 0;
+
+        mapped_file* wb_file_ = nullptr;
+        uint64_t wb_offset_ = 0;
+        std::size_t wb_n_ = 0, wb_mark_ = 0;
+        /* the step being written back and the one before it */
+        std::size_t wb_begin_ = 0, wb_end_ = 0;
+
+        bool nt_store_ = false;
+        T line_[line_n];
+        std::size_t line_pos_ = 0, line_cap_ = line_n;
+
+        run_footer_writer<T> footer_;
 };
 
+/* Encodes a run with run_codec into a byte stream of the Base kind: a u64
+ * count of the values, then the frames. The result is written raw */
+template<typename T, typename Base>
+class _chunk_ostream<T, chunk_stream_packed<Base>>
+{
+        using codec = run_codec<T>;
+public:
+        _chunk_ostream() = default;
+
+        explicit _chunk_ostream(std::string&& filename)
+                : filename_(std::move(filename))
+        {}
+
+        /* the errors are reported by an explicit close() */
+        ~_chunk_ostream()
+        {
+                try
+                {
+                        close();
+                }
+                catch (...)
+                {
+                }
+        }
+
+        _chunk_ostream(_chunk_ostream&&) = default;
+        _chunk_ostream& operator=(_chunk_ostream&&) = default;
+
+        void open(size_t buff_size, uint64_t size)
+        {
+                /* the footer describes the values, not their encoding */
+                os_.footer(false);
+                os_.filename(filename_);
+                os_.open(buff_size, size);
+                opened_ = true;
+
+                count_ = size / sizeof(T);
+                written_ = 0;
+                encoded_ = 0;
+
+                if (raw_)
+                        return;
+
+                frame_.reset(new T[codec::frame_n]);
+                buffer_.reset(new char[codec::max_frame_size]);
+                cur_ = frame_.get();
+
+                uint64_t count = count_;
+                os_.write(reinterpret_cast<const uint8_t*>(&count),
+                          sizeof(count));
+                encoded_ += sizeof(count);
+        }
+
+        void put(T v)
+        {
+                if (raw_)
+                {
+                        write(&v, 1);
+                        return;
+                }
+
+                *cur_++ = v;
+
+                if (cur_ == frame_.get() + codec::frame_n)
+                        _commit();
+        }
+
+        void write(const T* data, std::size_t n)
+        {
+                if (raw_)
+                {
+                        written_ += n;
+                        os_.write(reinterpret_cast<const uint8_t*>(data),
+                                  n * sizeof(T));
+                        return;
+                }
+
+                while (n)
+                {
+                        T* end = frame_.get() + codec::frame_n;
+                        std::size_t k = std::min<std::size_t>(n, end - cur_);
+
+                        mem_copy(cur_, data, k * sizeof(T));
+                        cur_ += k;
+                        data += k;
+                        n -= k;
+
+                        if (cur_ == end)
+                                _commit();
+                }
+        }
+
+        void close()
+        {
+                if (!opened_)
+                        return;
+
+                opened_ = false;
+
+                if (!raw_ && cur_ != frame_.get())
+                        _commit();
+
+                os_.close();
+
+                if (written_ != count_)
+                        THROW_FILE_EXCEPTION(filename_)
+                                << "File is broken, " << written_ << " of "
+                                << count_ << " values are written";
+
+                if (!raw_)
+                        footer_.write(filename_, run_trailer::codec_packed,
+                                      encoded_);
+        }
+
+        /* the values are written as they are, without the header */
+        void raw(bool value) { raw_ = value; }
+
+        /* the run footer is written on close, the default for the runs */
+        void footer(bool enable) { footer_.enable(enable); }
+
+        size_t buff_size() const { return os_.buff_size(); }
+
+        /* bytes of the encoded run written so far */
+        uint64_t bytes_written() const { return os_.bytes_written(); }
+
+        void filename(const std::string& value) { filename_ = value; }
+        std::string filename() const { return filename_; }
+private:
+        void _commit()
+        {
+                std::size_t n = cur_ - frame_.get();
+                std::size_t size = codec::encode(frame_.get(), n,
+                                                 buffer_.get());
+
+                footer_.add(frame_.get(), n);
+                os_.write(reinterpret_cast<const uint8_t*>(buffer_.get()),
+                          size);
+
+                encoded_ += size;
+                written_ += n;
+                cur_ = frame_.get();
+        }
+private:
+        _chunk_ostream<uint8_t, Base> os_;
+        std::string filename_;
+        bool opened_ = false;
+        bool raw_ = false;
+
+        std::unique_ptr<T[]> frame_;
+        std::unique_ptr<char[]> buffer_;
+        T* cur_ = nullptr;
+
+        uint64_t count_ = 0, written_ = 0;
+        /* bytes of the header and the frames */
+        uint64_t encoded_ = 0;
+        run_footer_writer<T> footer_;
+};
+
+/* the result is never encoded and has no footer */
+template<typename T, typename Type>
+void raw_output(_chunk_ostream<T, Type>& os)
+{
+        os.footer(false);
+}
+
+template<typename T, typename Base>
+void raw_output(_chunk_ostream<T, chunk_stream_packed<Base>>& os)
+{
+        os.raw(true);
+        os.footer(false);
+}
+
 template<typename T>
 class chunk_ostream_iterator
         : public std::iterator<std::output_iterator_tag, void, void, void, void>
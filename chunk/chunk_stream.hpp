@@ -6,6 +6,9 @@
 struct chunk_stream_cpp {};
 struct chunk_stream_stdio {};
 struct chunk_stream_mmap {};
+struct chunk_stream_uring {};
+/* output only, a descriptor written sequentially (stdout) */
+struct chunk_stream_fd {};
 
 template<typename T, typename Type>
 class _chunk_istream;
@@ -19,9 +22,40 @@ using cpp_stdio_stream_type = std::conditional<_use_cpp_streams,
                                                chunk_stream_cpp, 
                                                chunk_stream_stdio>::type;
 
+#if defined(__linux__)
+constexpr bool _use_uring_streams = IS_ENABLED(CONFIG_USE_URING);
+#else
+constexpr bool _use_uring_streams = false;
+#endif
+
+using file_stream_type = std::conditional<_use_uring_streams,
+                                          chunk_stream_uring,
+                                          cpp_stdio_stream_type>::type;
+
+/* the runs of a Base file stream encoded with run_codec */
+template<typename Base>
+struct chunk_stream_packed {};
+
+template<typename Type>
+struct is_packed_stream : std::false_type {};
+
+template<typename Base>
+struct is_packed_stream<chunk_stream_packed<Base>> : std::true_type {};
+
+constexpr bool _use_run_codec = !IS_ENABLED(CONFIG_USE_MMAP)
+        && IS_ENABLED(CONFIG_RUN_CODEC);
+
+using run_stream_type = std::conditional<_use_run_codec,
+                                         chunk_stream_packed<file_stream_type>,
+                                         file_stream_type>::type;
+
 using chunk_stream_type = std::conditional<IS_ENABLED(CONFIG_USE_MMAP),
                                            chunk_stream_mmap, 
-                                           cpp_stdio_stream_type>::type;
+                                           run_stream_type>::type;
+
+constexpr bool _use_direct_io = !IS_ENABLED(CONFIG_USE_MMAP)
+        && std::is_same<file_stream_type, chunk_stream_uring>::value
+        && IS_ENABLED(CONFIG_USE_DIRECT_IO);
 
 template<typename T>
 using chunk_istream = _chunk_istream<T, chunk_stream_type>;
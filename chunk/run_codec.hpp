@@ -0,0 +1,223 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Delta + frame-of-reference bit-packing of the sorted runs. A run is cut
+ * into frames of up to frame_n values:
+ *
+ *      u8      n       values in the frame
+ *      u8      width   bits per packed delta or raw_width
+ *      T       base    the first value
+ *      T       min     the smallest delta
+ *      ...             n - 1 deltas minus min, width bits each, LSB first
+ *
+ * A raw frame is n and raw_width followed by the n values as they are, it's
+ * used if packing doesn't make the frame smaller or the values aren't
+ * ascending, so any data goes through losslessly */
+template<typename T>
+class run_codec
+{
+        static_assert(std::is_integral<T>::value, "T must be integral");
+
+        using U = typename std::make_unsigned<T>::type;
+public:
+        static constexpr std::size_t frame_n = 128;
+        static constexpr uint8_t raw_width = 0xFF;
+
+        /* the decoder takes the bits through a 64-bit window at a byte
+         * boundary, the wider deltas are stored raw */
+        static constexpr unsigned max_width = 57;
+
+        static constexpr std::size_t head_size = 2;
+        static constexpr std::size_t max_frame_size = head_size
+                                                    + frame_n * sizeof(T);
+
+        /* bytes the decoder may read past the end of a frame */
+        static constexpr std::size_t padding = sizeof(uint64_t);
+
+        /* size of the whole frame by its head */
+        static std::size_t frame_size(const char* head)
+        {
+                std::size_t n = (uint8_t)head[0];
+                unsigned width = (uint8_t)head[1];
+
+                if (width == raw_width)
+                        return head_size + n * sizeof(T);
+
+                return head_size + 2 * sizeof(T) + packed_size(n - 1, width);
+        }
+
+        /* the head read from a run describes a frame the decoder can take:
+         * 1..frame_n values of a known width in max_frame_size bytes */
+        static bool valid_head(const char* head)
+        {
+                std::size_t n = (uint8_t)head[0];
+                unsigned width = (uint8_t)head[1];
+
+                return n >= 1 && n <= frame_n
+                        && (width == raw_width || width <= max_width)
+                        && frame_size(head) <= max_frame_size;
+        }
+
+        /* 1..frame_n values, out must have room for max_frame_size,
+         * returns the size of the frame */
+        static std::size_t encode(const T* in, std::size_t n, char* out)
+        {
+                U min = n > 1 ? std::numeric_limits<U>::max() : 0;
+                U max = 0;
+
+                bool ascending = true;
+
+                for (std::size_t i = 1; i < n; ++i)
+                {
+                        if (in[i] < in[i - 1])
+                        {
+                                ascending = false;
+                                break;
+                        }
+
+                        U d = U(in[i]) - U(in[i - 1]);
+
+                        min = d < min ? d : min;
+                        max = d > max ? d : max;
+                }
+
+                unsigned width = ascending ? bit_width(max - min) : raw_width;
+
+                std::size_t raw_size = head_size + n * sizeof(T);
+
+                out[0] = (char)n;
+
+                if (width > max_width || head_size + 2 * sizeof(T)
+                    + packed_size(n - 1, width) >= raw_size)
+                {
+                        out[1] = (char)raw_width;
+                        std::memcpy(out + head_size, in, n * sizeof(T));
+
+                        return raw_size;
+                }
+
+                out[1] = (char)width;
+                std::memcpy(out + head_size, &in[0], sizeof(T));
+                std::memcpy(out + head_size + sizeof(T), &min, sizeof(T));
+
+                char* p = out + head_size + 2 * sizeof(T);
+                uint64_t acc = 0;
+                unsigned bits = 0;
+
+                for (std::size_t i = 1; i < n; ++i)
+                {
+                        uint64_t d = U(U(in[i]) - U(in[i - 1]) - min);
+
+                        acc |= d << bits;
+                        bits += width;
+
+                        for (; bits >= 8; bits -= 8)
+                        {
+                                *p++ = (char)acc;
+                                acc >>= 8;
+                        }
+                }
+
+                if (bits)
+                        *p++ = (char)acc;
+
+                return p - out;
+        }
+
+        /* the frame must be followed by padding readable bytes, out must
+         * have room for frame_n values, returns the number of values */
+        static std::size_t decode(const char* in, T* out)
+        {
+                std::size_t n = (uint8_t)in[0];
+                unsigned width = (uint8_t)in[1];
+
+                if (width == raw_width)
+                {
+                        std::memcpy(out, in + head_size, n * sizeof(T));
+                        return n;
+                }
+
+                U base, min;
+                std::memcpy(&base, in + head_size, sizeof(T));
+                std::memcpy(&min, in + head_size + sizeof(T), sizeof(T));
+
+                const char* p = in + head_size + 2 * sizeof(T);
+                const uint64_t mask = (uint64_t(1) << width) - 1;
+
+                U* d = reinterpret_cast<U*>(out);
+                d[0] = base;
+
+                std::size_t bit = 0;
+
+                for (std::size_t i = 1; i < n; ++i, bit += width)
+                {
+                        uint64_t w;
+                        std::memcpy(&w, p + (bit >> 3), sizeof(w));
+
+                        d[i] = U((w >> (bit & 7)) & mask) + min;
+                }
+
+                prefix_sum(d, n, std::integral_constant<std::size_t,
+                                                        sizeof(U)>());
+
+                return n;
+        }
+private:
+        static std::size_t packed_size(std::size_t n, unsigned width)
+        {
+                return (n * width + 7) / 8;
+        }
+
+        static unsigned bit_width(U v)
+        {
+                unsigned width = 0;
+
+                for (; v; v >>= 1)
+                        ++width;
+
+                return width;
+        }
+
+        template<std::size_t Size>
+        static void prefix_sum(U* d, std::size_t n,
+                               std::integral_constant<std::size_t, Size>)
+        {
+                for (std::size_t i = 1; i < n; ++i)
+                        d[i] += d[i - 1];
+        }
+
+#if defined(__SSE2__)
+        /* four sums at once, the last lane is carried to the next ones */
+        static void prefix_sum(U* d, std::size_t n,
+                               std::integral_constant<std::size_t, 4>)
+        {
+                __m128i carry = _mm_set1_epi32((int)d[0]);
+                std::size_t i = 1;
+
+                for (; i + 4 <= n; i += 4)
+                {
+                        auto p = reinterpret_cast<__m128i*>(d + i);
+                        __m128i x = _mm_loadu_si128(p);
+
+                        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+                        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+                        x = _mm_add_epi32(x, carry);
+
+                        _mm_storeu_si128(p, x);
+                        carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+                }
+
+                for (; i < n; ++i)
+                        d[i] += d[i - 1];
+        }
+#endif
+};
@@ -0,0 +1,107 @@
+#include "run_footer.hpp"
+
+#include <cstddef>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+static uint32_t footer_checksum(const run_trailer& trailer,
+                                const std::vector<uint32_t>& sums,
+                                const std::vector<uint64_t>& fences)
+{
+        uint64_t h = 0xcbf29ce484222325ull;
+
+        auto put = [&h](const void* data, std::size_t size)
+        {
+                auto p = static_cast<const unsigned char*>(data);
+
+                for (std::size_t i = 0; i < size; ++i)
+                        h = (h ^ p[i]) * 0x100000001b3ull;
+        };
+
+        put(&trailer, offsetof(run_trailer, checksum));
+        put(sums.data(), sums.size() * sizeof(uint32_t));
+        put(fences.data(), fences.size() * sizeof(uint64_t));
+
+        return (uint32_t)(h ^ (h >> 32));
+}
+
+void write_run_footer(const std::string& filename, run_trailer& trailer,
+                      const std::vector<uint32_t>& sums,
+                      const std::vector<uint64_t>& fences)
+{
+        if (fences.size() != sums.size())
+                THROW_FILE_EXCEPTION(filename)
+                        << "The run has " << sums.size() << " blocks but "
+                        << fences.size() << " fences";
+
+        trailer.magic = run_trailer::magic_value;
+        trailer.version = run_trailer::version_value;
+        trailer.blocks = sums.size();
+        trailer.checksum = footer_checksum(trailer, sums, fences);
+
+        int fd = ::open(filename.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd == -1)
+                THROW_FILE_EXCEPTION(filename) << "Cannot open the file";
+
+        std::size_t sums_size = sums.size() * sizeof(uint32_t);
+        std::size_t fences_size = fences.size() * sizeof(uint64_t);
+        uint64_t offset = trailer.data_size;
+        uint64_t end = offset + sums_size + fences_size;
+
+        bool ok = pwrite(fd, sums.data(), sums_size, offset)
+                        == (ssize_t)sums_size
+                && pwrite(fd, fences.data(), fences_size, offset + sums_size)
+                        == (ssize_t)fences_size
+                && pwrite(fd, &trailer, sizeof(trailer), end)
+                        == (ssize_t)sizeof(trailer)
+                && ftruncate(fd, end + sizeof(trailer)) == 0;
+
+        ::close(fd);
+
+        if (!ok)
+                THROW_FILE_EXCEPTION(filename) << "Cannot write the footer";
+}
+
+void read_run_footer(const std::string& filename, run_trailer& trailer,
+                     std::vector<uint32_t>& sums,
+                     std::vector<uint64_t>& fences)
+{
+        int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+                THROW_FILE_EXCEPTION(filename) << "Cannot open the file";
+
+        off_t size = lseek(fd, 0, SEEK_END);
+
+        bool ok = size >= (off_t)sizeof(trailer)
+                && pread(fd, &trailer, sizeof(trailer),
+                         size - sizeof(trailer)) == (ssize_t)sizeof(trailer)
+                && trailer.magic == run_trailer::magic_value
+                && trailer.version == run_trailer::version_value
+                && trailer.data_size + trailer.blocks
+                        * (sizeof(uint32_t) + sizeof(uint64_t))
+                        + sizeof(trailer) == (uint64_t)size;
+
+        if (ok)
+        {
+                sums.resize(trailer.blocks);
+                fences.resize(trailer.blocks);
+
+                std::size_t sums_size = sums.size() * sizeof(uint32_t);
+                std::size_t fences_size = fences.size() * sizeof(uint64_t);
+
+                ok = pread(fd, sums.data(), sums_size, trailer.data_size)
+                                == (ssize_t)sums_size
+                        && pread(fd, fences.data(), fences_size,
+                                 trailer.data_size + sums_size)
+                                == (ssize_t)fences_size
+                        && trailer.checksum
+                                == footer_checksum(trailer, sums, fences);
+        }
+
+        ::close(fd);
+
+        if (!ok)
+                THROW_FILE_EXCEPTION(filename)
+                        << "The run is broken, it has no valid footer";
+}
@@ -0,0 +1,407 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../config.hpp"
+#include "../tools/exception.hpp"
+#include "run_index.hpp"
+
+/* A run file describes itself, the data is followed by a footer:
+ *
+ *      data            the values, or the run_codec stream
+ *      u32[blocks]     checksums of every run_block_n values
+ *      u64[blocks]     the first value of every block, the run_index
+ *      run_trailer     64 bytes at the very end
+ *
+ * The data stays at the start of the file, so the runs are mapped and read
+ * with O_DIRECT as before. The checksums are of the values, not of their
+ * encoding, so they are verified after the decoding */
+struct run_trailer
+{
+        static constexpr uint64_t magic_value = 0x314e55525453584eull;
+        static constexpr uint16_t version_value = 2;
+
+        enum : uint8_t
+        {
+                codec_raw,
+                codec_packed
+        };
+
+        uint64_t magic;
+        uint16_t version;
+        uint8_t elem_size;
+        uint8_t codec;
+        /* values per checksum block */
+        uint32_t block_n;
+        uint64_t count;
+        /* bytes from the start of the file to the footer */
+        uint64_t data_size;
+        /* the first and the last value, the run is sorted */
+        uint64_t min;
+        uint64_t max;
+        uint64_t blocks;
+        uint32_t reserved;
+        /* of the fields above, the block checksums and the fences */
+        uint32_t checksum;
+};
+
+static_assert(sizeof(run_trailer) == 64, "run_trailer must be 64 bytes");
+
+/* appends the footer at trailer.data_size and cuts the file after it,
+ * fences - the bits of the first value of every block */
+void write_run_footer(const std::string& filename, run_trailer& trailer,
+                      const std::vector<uint32_t>& sums,
+                      const std::vector<uint64_t>& fences);
+
+/* throws if the file has no valid footer */
+void read_run_footer(const std::string& filename, run_trailer& trailer,
+                     std::vector<uint32_t>& sums,
+                     std::vector<uint64_t>& fences);
+
+/* Values of a run as they are written or read: the count, the bounds,
+ * a checksum of every run_block_n values and their fences */
+template<typename T>
+class run_summary
+{
+        static_assert(sizeof(T) <= sizeof(uint64_t),
+                      "T must fit the trailer bounds");
+public:
+        void add(T v)
+        {
+                if (!count_)
+                        first_ = v;
+
+                last_ = v;
+                ++count_;
+
+                index_.add(v);
+
+                _mix(h_[in_block_ % lanes], v);
+
+                if (++in_block_ == run_block_n)
+                        _close_block();
+        }
+
+        void add(const T* data, std::size_t n)
+        {
+                if (!n)
+                        return;
+
+                if (!count_)
+                        first_ = data[0];
+
+                last_ = data[n - 1];
+                count_ += n;
+
+                index_.add(data, n);
+
+                while (n)
+                {
+                        std::size_t k = std::min<std::size_t>(
+                                n, run_block_n - in_block_);
+
+                        _mix_block(data, k);
+
+                        data += k;
+                        n -= k;
+                }
+        }
+
+        /* closes the partial block at the end */
+        void finish()
+        {
+                if (in_block_)
+                        _close_block();
+        }
+
+        uint64_t count() const { return count_; }
+
+        const std::vector<uint32_t>& sums() const { return sums_; }
+
+        const run_index<T>& index() const { return index_; }
+
+        std::vector<uint64_t> fence_bits() const
+        {
+                std::vector<uint64_t> fences;
+                fences.reserve(index_.fences().size());
+
+                for (auto& v : index_.fences())
+                        fences.push_back(bits(v));
+
+                return fences;
+        }
+
+        run_trailer trailer(uint8_t codec, uint64_t data_size) const
+        {
+                run_trailer t = {};
+                t.elem_size = sizeof(T);
+                t.codec = codec;
+                t.block_n = run_block_n;
+                t.count = count_;
+                t.data_size = data_size;
+                t.min = count_ ? bits(first_) : 0;
+                t.max = count_ ? bits(last_) : 0;
+
+                return t;
+        }
+
+        static uint64_t bits(T v)
+        {
+                uint64_t b = 0;
+                std::memcpy(&b, &v, sizeof(T));
+
+                return b;
+        }
+
+        static T value(uint64_t b)
+        {
+                T v;
+                std::memcpy(&v, &b, sizeof(T));
+
+                return v;
+        }
+private:
+        static constexpr uint64_t mul = 0x9e3779b97f4a7c15ull;
+
+        /* the values go to the lanes in turn, the independent chains of
+         * multiplies keep up with the merge */
+        static constexpr std::size_t lanes = 4;
+
+        static void _mix(uint64_t& h, T v)
+        {
+                h = (h ^ bits(v)) * mul;
+        }
+
+        /* n values which don't cross the block */
+        void _mix_block(const T* data, std::size_t n)
+        {
+                const T* end = data + n;
+
+                for (; data != end && in_block_ % lanes; ++data)
+                        _mix(h_[in_block_++ % lanes], *data);
+
+                uint64_t h0 = h_[0], h1 = h_[1], h2 = h_[2], h3 = h_[3];
+                std::size_t body = (end - data) / lanes * lanes;
+
+                for (const T* p = data; p != data + body; p += lanes)
+                {
+                        _mix(h0, p[0]);
+                        _mix(h1, p[1]);
+                        _mix(h2, p[2]);
+                        _mix(h3, p[3]);
+                }
+
+                h_[0] = h0; h_[1] = h1; h_[2] = h2; h_[3] = h3;
+                data += body;
+                in_block_ += body;
+
+                for (; data != end; ++data)
+                        _mix(h_[in_block_++ % lanes], *data);
+
+                if (in_block_ == run_block_n)
+                        _close_block();
+        }
+
+        static uint32_t fold(uint64_t h)
+        {
+                return (uint32_t)(h ^ (h >> 32));
+        }
+
+        /* every block starts from its own seed, so the reordered blocks
+         * don't pass */
+        void _close_block()
+        {
+                uint64_t h = h_[0];
+
+                for (std::size_t i = 1; i < lanes; ++i)
+                        h = (h ^ h_[i]) * mul;
+
+                sums_.push_back(fold(h));
+                in_block_ = 0;
+
+                uint64_t seed = (sums_.size() + 1) * mul;
+
+                for (std::size_t i = 0; i < lanes; ++i)
+                        h_[i] = seed + i;
+        }
+private:
+        std::vector<uint32_t> sums_;
+        run_index<T> index_;
+        uint64_t count_ = 0;
+        T first_ = T(), last_ = T();
+        uint64_t h_[lanes] = { mul, mul + 1, mul + 2, mul + 3 };
+        std::size_t in_block_ = 0;
+};
+
+/* The footer of a run file being written, the streams feed it the values
+ * and write it out after the data on close */
+template<typename T>
+class run_footer_writer
+{
+public:
+        /* the result and the byte streams under the codec have no footer */
+        void enable(bool value) { enabled_ = value; }
+        bool enabled() const { return enabled_; }
+
+        /* the run_index of the run is built into the given one as it's
+         * written, with or without a footer, it's complete on write() */
+        void index(std::shared_ptr<run_index<T>> index)
+        {
+                index_ = std::move(index);
+        }
+
+        void add(T v)
+        {
+                if (enabled_)
+                        summary_.add(v);
+                else if (index_)
+                        index_->add(v);
+        }
+
+        void add(const T* data, std::size_t n)
+        {
+                if (enabled_)
+                        summary_.add(data, n);
+                else if (index_)
+                        index_->add(data, n);
+        }
+
+        /* the values are written as they are */
+        void write(const std::string& filename)
+        {
+                write(filename, run_trailer::codec_raw,
+                      summary_.count() * sizeof(T));
+        }
+
+        void write(const std::string& filename, uint8_t codec,
+                   uint64_t data_size)
+        {
+                if (!enabled_)
+                        return;
+
+                summary_.finish();
+
+                auto trailer = summary_.trailer(codec, data_size);
+                write_run_footer(filename, trailer, summary_.sums(),
+                                 summary_.fence_bits());
+
+                if (index_)
+                        *index_ = summary_.index();
+
+                summary_ = run_summary<T>();
+        }
+private:
+        bool enabled_ = IS_ENABLED(CONFIG_RUN_FOOTER);
+        run_summary<T> summary_;
+        std::shared_ptr<run_index<T>> index_;
+};
+
+/* Reads the footer of a run file and verifies the values against it as
+ * they are read */
+template<typename T>
+class run_footer_reader
+{
+public:
+        void enable(bool value) { enabled_ = value; }
+        bool enabled() const { return enabled_; }
+
+        /* returns the size of the data, the whole file without a footer */
+        uint64_t open(const std::string& filename, uint8_t codec,
+                      uint64_t file_size)
+        {
+                if (!enabled_)
+                        return file_size;
+
+                filename_ = filename;
+
+                std::vector<uint64_t> fences;
+                read_run_footer(filename, trailer_, sums_, fences);
+
+                if (trailer_.elem_size != sizeof(T)
+                    || trailer_.codec != codec
+                    || trailer_.block_n != run_block_n)
+                        THROW_FILE_EXCEPTION(filename)
+                                << "The run is of another format: "
+                                << (unsigned)trailer_.elem_size
+                                << " byte values, codec "
+                                << (unsigned)trailer_.codec;
+
+                std::vector<T> values;
+                values.reserve(fences.size());
+
+                for (auto b : fences)
+                        values.push_back(run_summary<T>::value(b));
+
+                index_ = std::make_shared<run_index<T>>(std::move(values),
+                                                        trailer_.count);
+
+                summary_ = run_summary<T>();
+                checked_ = 0;
+
+                return trailer_.data_size;
+        }
+
+        void check(const T* data, std::size_t n)
+        {
+                if (!enabled_)
+                        return;
+
+                summary_.add(data, n);
+
+                if (summary_.count() > trailer_.count)
+                        THROW_FILE_EXCEPTION(filename_)
+                                << "The run is broken, more than "
+                                << trailer_.count << " values";
+
+                _check_blocks();
+        }
+
+        /* the last partial block is checked once all the values are read */
+        void finish()
+        {
+                if (!enabled_)
+                        return;
+
+                if (summary_.count() != trailer_.count)
+                        THROW_FILE_EXCEPTION(filename_)
+                                << "The run is broken, "
+                                << trailer_.count - summary_.count()
+                                << " values are missing";
+
+                summary_.finish();
+                _check_blocks();
+        }
+
+        uint64_t count() const { return trailer_.count; }
+        T min() const { return run_summary<T>::value(trailer_.min); }
+        T max() const { return run_summary<T>::value(trailer_.max); }
+
+        /* the fences of the run, null until open() */
+        std::shared_ptr<const run_index<T>> index() const { return index_; }
+private:
+        void _check_blocks()
+        {
+                auto& sums = summary_.sums();
+
+                for (; checked_ < sums.size(); ++checked_)
+                        if (checked_ >= sums_.size()
+                            || sums[checked_] != sums_[checked_])
+                                THROW_FILE_EXCEPTION(filename_)
+                                        << "The run is broken, block "
+                                        << checked_ << " doesn't match "
+                                        << "its checksum";
+        }
+private:
+        bool enabled_ = IS_ENABLED(CONFIG_RUN_FOOTER);
+        std::string filename_;
+        run_trailer trailer_ = {};
+        std::vector<uint32_t> sums_;
+        std::shared_ptr<const run_index<T>> index_;
+        run_summary<T> summary_;
+        std::size_t checked_ = 0;
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/* 64KiB of 32-bit values, a block is verified while it's in L2 */
+constexpr uint32_t run_block_n = 16 * 1024;
+
+/* Fence pointers of a sorted run: the first value of every run_block_n
+ * values. The block where a key goes is found by binary search over the
+ * fences without touching the data, so a lookup reads a single block */
+template<typename T>
+class run_index
+{
+public:
+        run_index() = default;
+
+        run_index(std::vector<T>&& fences, uint64_t count)
+                : fences_(std::move(fences)), count_(count)
+        {}
+
+        /* one strided pass over a sorted range */
+        static run_index build(const T* data, std::size_t n)
+        {
+                run_index index;
+                index.add(data, n);
+
+                return index;
+        }
+
+        /* the values of the run in order, as they are written */
+        void add(T v)
+        {
+                if (count_++ % run_block_n == 0)
+                        fences_.push_back(v);
+        }
+
+        void add(const T* data, std::size_t n)
+        {
+                std::size_t in_block = count_ % run_block_n;
+                std::size_t i = in_block ? run_block_n - in_block : 0;
+
+                for (; i < n; i += run_block_n)
+                        fences_.push_back(data[i]);
+
+                count_ += n;
+        }
+
+        bool empty() const { return count_ == 0; }
+
+        uint64_t count() const { return count_; }
+
+        const std::vector<T>& fences() const { return fences_; }
+
+        /* [first, last] of the positions where the first value not less
+         * than key is, at most a block apart */
+        std::pair<uint64_t, uint64_t> lower_range(const T& key) const
+        {
+                auto it = std::lower_bound(fences_.begin(), fences_.end(),
+                                           key);
+
+                return _range(it - fences_.begin());
+        }
+
+        /* the same for the first value greater than key */
+        std::pair<uint64_t, uint64_t> upper_range(const T& key) const
+        {
+                auto it = std::upper_bound(fences_.begin(), fences_.end(),
+                                           key);
+
+                return _range(it - fences_.begin());
+        }
+private:
+        /* the fence of block b is the first one past the key, the position
+         * is in the block before it or is the start of b */
+        std::pair<uint64_t, uint64_t> _range(std::size_t b) const
+        {
+                uint64_t last = std::min<uint64_t>(b * (uint64_t)run_block_n,
+                                                   count_);
+
+                if (b == 0)
+                        return { 0, 0 };
+
+                return { (b - 1) * (uint64_t)run_block_n, last };
+        }
+private:
+        std::vector<T> fences_;
+        uint64_t count_ = 0;
+};
@@ -0,0 +1,477 @@
+#include "run_manifest.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "run_codec.hpp"
+#include "run_footer.hpp"
+#include "../log.hpp"
+#include "../extra/crc64.hpp"
+#include "../tools/file.hpp"
+
+static const char* const manifest_magic = "external_sort manifest 2";
+
+/* bytes at the start and at the end of the input in its checksum */
+static constexpr std::size_t stamp_block_size = 64_KiB;
+
+/* the modification time of the input and the crc64 of its first and last
+ * blocks, another file of the same name and size doesn't pass for it */
+static std::string input_stamp(const std::string& input)
+{
+        int fd = ::open(input.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+                THROW_FILE_EXCEPTION(input) << "Cannot open the file";
+
+        struct stat st;
+        std::vector<uint8_t> block(stamp_block_size);
+        uint64_t crc = 0;
+        bool ok = fstat(fd, &st) == 0;
+
+        for (off_t off : { (off_t)0, st.st_size - (off_t)block.size() })
+        {
+                if (!ok)
+                        break;
+
+                off = std::max<off_t>(off, 0);
+
+                ssize_t r = pread(fd, block.data(), block.size(), off);
+
+                ok = r >= 0;
+
+                if (ok)
+                        crc = crc64(crc, block.data(), r);
+        }
+
+        ::close(fd);
+
+        if (!ok)
+                THROW_FILE_EXCEPTION(input) << "Cannot read the file";
+
+        std::stringstream ss;
+
+        ss << st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec << " "
+           << std::hex << crc;
+
+        return ss.str();
+}
+
+std::string run_manifest::_filename()
+{
+        return std::string(CONFIG_CHUNK_DIRS[0]) + "/manifest";
+}
+
+std::string run_manifest::_header(const job& j)
+{
+        std::stringstream ss;
+
+        ss << manifest_magic << " " << j.elem_size << " " << j.input_size
+           << " " << input_stamp(j.input) << " " << j.chunk_size << " " << j.sub_size << " " << j.n_way
+           << " " << j.input;
+
+        return ss.str();
+}
+
+std::string run_manifest::_line(const chunk_id& id, const record& r)
+{
+        std::stringstream ss;
+
+        ss << (r.merge ? "merge " : "sort ") << id << " " << r.size << " "
+           << r.count << " " << std::hex << r.checksum << std::dec << " "
+           << r.path;
+
+        if (r.merge)
+        {
+                ss << " ";
+
+                for (std::size_t i = 0; i < r.inputs.size(); ++i)
+                        ss << (i ? "," : "") << r.inputs[i];
+        }
+
+        ss << "\n";
+
+        return ss.str();
+}
+
+/* the merges are kept even if they're broken, they tell which chunks
+ * went into the valid runs above them */
+void run_manifest::open(const job& j)
+{
+        std::string filename = _filename();
+        std::string header = _header(j);
+
+        std::lock_guard<std::mutex> lk(lock_);
+
+        records_.clear();
+        covered_.clear();
+
+        if (access(filename.c_str(), F_OK) == 0
+            && file_size(filename.c_str()) != 0 && !_load(header))
+                info() << "Manifest " << quote(filename)
+                       << " is of another job, starting over";
+
+        /* only the valid records are written back */
+        std::string tmp = filename + ".tmp";
+        std::string data = header + "\n";
+
+        for (auto& r : records_)
+                data += _line(r.first, r.second);
+
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0644);
+        if (fd == -1)
+                THROW_FILE_EXCEPTION(tmp) << "Cannot create the manifest";
+
+        bool ok = write(fd, data.data(), data.size()) == (ssize_t)data.size()
+                && fdatasync(fd) == 0;
+
+        ::close(fd);
+
+        if (!ok || rename(tmp.c_str(), filename.c_str()) != 0)
+                THROW_FILE_EXCEPTION(filename) << "Cannot write the manifest";
+
+        fd_ = ::open(filename.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd_ == -1)
+                THROW_FILE_EXCEPTION(filename) << "Cannot open the manifest";
+
+        if (!records_.empty())
+                info() << "Resuming, " << records_.size()
+                       << " runs are kept from " << quote(filename);
+}
+
+bool run_manifest::_load(const std::string& header)
+{
+        auto data = file_read_all(_filename());
+        std::string text(data.begin(), data.end());
+
+        /* a line cut by the crash is dropped */
+        text.erase(text.find_last_of('\n') + 1);
+
+        std::istringstream is(text);
+        std::string line;
+
+        if (!std::getline(is, line) || line != header)
+                return false;
+
+        std::map<chunk_id, record> all;
+
+        while (std::getline(is, line))
+        {
+                std::istringstream ls(line);
+                std::string kind, id, inputs;
+                record r;
+
+                ls >> kind >> id >> r.size >> r.count >> std::hex
+                   >> r.checksum >> std::dec >> r.path;
+
+                r.merge = kind == "merge";
+
+                if (r.merge)
+                        ls >> inputs;
+
+                try
+                {
+                        if (!ls || (!r.merge && kind != "sort"))
+                                THROW_EXCEPTION << "Unknown record";
+
+                        std::istringstream ins(inputs);
+                        std::string input;
+
+                        while (std::getline(ins, input, ','))
+                                r.inputs.emplace_back(input.c_str());
+
+                        all[chunk_id(id.c_str())] = std::move(r);
+                }
+                catch (const std::exception& e)
+                {
+                        error() << "Manifest line " << quote(line)
+                                << " is broken, ignored: " << e.what();
+                }
+        }
+
+        for (auto& r : all)
+        {
+                if (!_valid(r.second))
+                {
+                        info() << "Run " << r.first << " "
+                               << quote(r.second.path)
+                               << " doesn't match the manifest, it's redone";
+                        continue;
+                }
+
+                records_.insert(r);
+        }
+
+        std::vector<chunk_id> stack;
+
+        for (auto& r : records_)
+                stack.push_back(r.first);
+
+        while (!stack.empty())
+        {
+                chunk_id id = stack.back();
+                stack.pop_back();
+
+                if (!covered_.insert(id).second)
+                        continue;
+
+                auto found = all.find(id);
+                if (found != all.end())
+                        stack.insert(stack.end(),
+                                     found->second.inputs.begin(),
+                                     found->second.inputs.end());
+        }
+
+        return true;
+}
+
+static constexpr std::size_t verify_buff_size = 1_MiB;
+
+/* the values of a raw run as they are */
+template<typename U>
+static bool sum_raw_run(int fd, const run_trailer& trailer,
+                        run_summary<U>& summary)
+{
+        if (trailer.data_size != trailer.count * sizeof(U))
+                return false;
+
+        std::vector<U> values(verify_buff_size / sizeof(U));
+
+        for (uint64_t off = 0; off < trailer.data_size;)
+        {
+                std::size_t len = std::min<uint64_t>(
+                        values.size() * sizeof(U), trailer.data_size - off);
+
+                if (pread(fd, values.data(), len, off) != (ssize_t)len)
+                        return false;
+
+                summary.add(values.data(), len / sizeof(U));
+                off += len;
+        }
+
+        return true;
+}
+
+/* the run_codec frames after the u64 count are decoded, the footer sums
+ * the values and not their encoding */
+template<typename U>
+static bool sum_packed_run(int fd, const run_trailer& trailer,
+                           run_summary<U>& summary)
+{
+        using codec = run_codec<U>;
+
+        uint64_t count = 0;
+
+        if (pread(fd, &count, sizeof(count), 0) != (ssize_t)sizeof(count)
+            || count != trailer.count)
+                return false;
+
+        std::vector<char> buff(verify_buff_size + codec::padding);
+        std::vector<U> frame(codec::frame_n);
+        uint64_t off = sizeof(count);
+        std::size_t pos = 0, end = 0;
+
+        while (summary.count() < count)
+        {
+                if (end - pos < codec::max_frame_size
+                    && off < trailer.data_size)
+                {
+                        std::memmove(buff.data(), buff.data() + pos,
+                                     end - pos);
+                        end -= pos;
+                        pos = 0;
+
+                        std::size_t len = std::min<uint64_t>(
+                                verify_buff_size - end,
+                                trailer.data_size - off);
+
+                        if (pread(fd, buff.data() + end, len, off)
+                            != (ssize_t)len)
+                                return false;
+
+                        end += len;
+                        off += len;
+                }
+
+                const char* head = buff.data() + pos;
+
+                if (end - pos < codec::head_size
+                    || !codec::valid_head(head)
+                    || codec::frame_size(head) > end - pos)
+                        return false;
+
+                pos += codec::frame_size(head);
+                summary.add(frame.data(), codec::decode(head, frame.data()));
+        }
+
+        return pos == end && off == trailer.data_size;
+}
+
+/* One sequential read of the data checked against the block checksums of
+ * the footer. The checksums are of the bits of the values, an unsigned
+ * type of the same size stands for any T */
+template<typename U>
+static bool verify_run(const std::string& path, const run_trailer& trailer,
+                       const std::vector<uint32_t>& sums)
+{
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+                return false;
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        run_summary<U> summary;
+        bool ok;
+
+        if (trailer.codec == run_trailer::codec_raw)
+                ok = sum_raw_run(fd, trailer, summary);
+        else if (trailer.codec == run_trailer::codec_packed)
+                ok = sum_packed_run(fd, trailer, summary);
+        else
+                ok = false;
+
+        ::close(fd);
+
+        if (!ok)
+                return false;
+
+        summary.finish();
+
+        return summary.count() == trailer.count && summary.sums() == sums;
+}
+
+bool run_manifest::_valid(const record& r) const
+{
+        run_trailer trailer;
+        std::vector<uint32_t> sums;
+        std::vector<uint64_t> fences;
+
+        try
+        {
+                read_run_footer(r.path, trailer, sums, fences);
+        }
+        catch (const std::exception&)
+        {
+                return false;
+        }
+
+        if (trailer.checksum != r.checksum || trailer.count != r.count
+            || trailer.data_size != r.size
+            || trailer.block_n != run_block_n)
+                return false;
+
+        switch (trailer.elem_size)
+        {
+        case 1: return verify_run<uint8_t>(r.path, trailer, sums);
+        case 2: return verify_run<uint16_t>(r.path, trailer, sums);
+        case 4: return verify_run<uint32_t>(r.path, trailer, sums);
+        case 8: return verify_run<uint64_t>(r.path, trailer, sums);
+        default: return false;
+        }
+}
+
+void run_manifest::sorted(const chunk_id& id)
+{
+        record r{};
+        r.merge = false;
+
+        _append(id, std::move(r));
+}
+
+void run_manifest::merged(const chunk_id& id,
+                          const std::vector<chunk_id>& inputs)
+{
+        record r{};
+        r.merge = true;
+        r.inputs = inputs;
+
+        _append(id, std::move(r));
+}
+
+/* the run is synced before it's recorded, so a record never outlives the
+ * data after a power loss */
+void run_manifest::_append(const chunk_id& id, record&& r)
+{
+        r.path = id.to_full_filename();
+
+        run_trailer trailer;
+        std::vector<uint32_t> sums;
+        std::vector<uint64_t> fences;
+
+        read_run_footer(r.path, trailer, sums, fences);
+
+        r.size = trailer.data_size;
+        r.count = trailer.count;
+        r.checksum = trailer.checksum;
+
+        int fd = ::open(r.path.c_str(), O_RDONLY | O_CLOEXEC);
+        bool synced = fd != -1 && fdatasync(fd) == 0;
+
+        if (fd != -1)
+                ::close(fd);
+
+        if (!synced)
+                THROW_FILE_EXCEPTION(r.path) << "Cannot sync the run";
+
+        std::string line = _line(id, r);
+
+        std::lock_guard<std::mutex> lk(lock_);
+
+        if (write(fd_, line.data(), line.size()) != (ssize_t)line.size()
+            || fdatasync(fd_) != 0)
+                THROW_FILE_EXCEPTION(_filename())
+                        << "Cannot append to the manifest";
+
+        records_[id] = std::move(r);
+}
+
+bool run_manifest::done(const chunk_id& id) const
+{
+        std::lock_guard<std::mutex> lk(lock_);
+
+        auto found = records_.find(id);
+
+        return found != records_.end()
+                && found->second.path == id.to_full_filename();
+}
+
+bool run_manifest::done(const chunk_id& id,
+                        const std::vector<chunk_id>& inputs) const
+{
+        std::lock_guard<std::mutex> lk(lock_);
+
+        auto found = records_.find(id);
+
+        return found != records_.end()
+                && found->second.path == id.to_full_filename()
+                && found->second.inputs == inputs;
+}
+
+bool run_manifest::covers(const chunk_id& id) const
+{
+        std::lock_guard<std::mutex> lk(lock_);
+
+        return covered_.count(id) != 0;
+}
+
+run_manifest::~run_manifest()
+{
+        if (fd_ != -1)
+                ::close(fd_);
+}
+
+void run_manifest::remove()
+{
+        std::lock_guard<std::mutex> lk(lock_);
+
+        if (fd_ == -1)
+                return;
+
+        ::close(fd_);
+        fd_ = -1;
+
+        delete_file(_filename().c_str());
+}
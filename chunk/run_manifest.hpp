@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "chunk_id.hpp"
+
+/* The checkpoint of a job which spills its runs to CONFIG_CHUNK_DIRS: every
+ * sorted chunk and every merge of the task tree is appended to
+ * CONFIG_CHUNK_DIRS[0]/manifest once its run is complete, with the size,
+ * the count and the checksum of the run footer. A job restarted with the
+ * same input and parameters keeps the runs which still match their
+ * records and redoes the rest. The input is known by its modification time
+ * and the crc64 of its first and last 64KiB, the job leaves it intact:
+ *
+ *      external_sort manifest 2 <elem size> <input size> <input mtime>
+ *                    <input crc64> <chunk size> <sub-chunk size> <fan-in>
+ *                    <input filename>
+ *      sort <id> <size> <count> <checksum> <path>
+ *      merge <id> <size> <count> <checksum> <path> <input id>,...
+ *
+ * On restart every kept run is read once and its data is checked against
+ * the block checksums of its footer, a run which doesn't pass is redone */
+class run_manifest
+{
+public:
+        /* the parameters which make the same chunks and the same plan */
+        struct job
+        {
+                std::string input;
+                uint64_t input_size;
+                uint64_t chunk_size;
+                uint64_t sub_size;
+                uint64_t n_way;
+                uint32_t elem_size;
+        };
+
+        run_manifest() = default;
+        ~run_manifest();
+
+        run_manifest(const run_manifest&) = delete;
+        run_manifest& operator=(const run_manifest&) = delete;
+
+        /* loads the manifest of the same job and keeps the valid records,
+         * otherwise starts a new one */
+        void open(const job& j);
+
+        /* the run of the sorted chunk is complete and synced */
+        void sorted(const chunk_id& id);
+
+        /* the merge output is complete and synced */
+        void merged(const chunk_id& id, const std::vector<chunk_id>& inputs);
+
+        /* the run is valid and is at the path the plan gives it */
+        bool done(const chunk_id& id) const;
+
+        /* the same, the merge had the same inputs */
+        bool done(const chunk_id& id,
+                  const std::vector<chunk_id>& inputs) const;
+
+        /* the L0 chunk went into a valid run, it isn't sorted again */
+        bool covers(const chunk_id& id) const;
+
+        /* the job is complete */
+        void remove();
+
+        /* the number of runs kept from the previous attempt */
+        std::size_t kept() const { return records_.size(); }
+private:
+        struct record
+        {
+                bool merge;
+                uint64_t size;
+                uint64_t count;
+                uint32_t checksum;
+                std::string path;
+                std::vector<chunk_id> inputs;
+        };
+
+        static std::string _filename();
+        static std::string _header(const job& j);
+        static std::string _line(const chunk_id& id, const record& r);
+
+        bool _load(const std::string& header);
+        bool _valid(const record& r) const;
+        void _append(const chunk_id& id, record&& r);
+private:
+        std::map<chunk_id, record> records_;
+        std::set<chunk_id> covered_;
+        mutable std::mutex lock_;
+        int fd_ = -1;
+};
@@ -82,7 +82,11 @@ constexpr auto CONFIG_DEBUG = config::ON;
 constexpr const char* CONFIG_INPUT_FILENAME  = "input";
 constexpr const char* CONFIG_OUTPUT_FILENAME = "output";
 constexpr const char  CONFIG_CHUNK_NAME_SEP = '_';
-constexpr const char* CONFIG_CHUNK_DIR = "chunks";
+
+/* Scratch directories for the runs, one per device (NVMe, HDD), the runs
+ * are striped across them so the merges read and write different devices,
+ * e.g. { "/mnt/d0/chunks", "/mnt/d1/chunks" } */
+constexpr const char* CONFIG_CHUNK_DIRS[] = { "chunks" };
 
 constexpr auto CONFIG_REMOVE_TMP_FILES = config::OFF;
 
@@ -90,8 +94,85 @@ constexpr auto CONFIG_USE_MMAP = config::ON;
 
 constexpr auto CONFIG_PREFER_BOOST_MMAP = config::OFF;
 
+/* Mapping policies, CONFIG_SORT_MAP_POLICY and CONFIG_MERGE_MAP_POLICY are
+ * made of them:
+ *   POPULATE - a range is faulted in at once (MADV_POPULATE_READ/WRITE), the
+ *              whole chunk for the sort, a window at a time for the merge
+ *   HUGEPAGE - MADV_HUGEPAGE, takes effect for the anonymous and the tmpfs
+ *              memory only
+ *   WILLNEED - the kernel reads ahead: the next chunk while one is sorted,
+ *              CONFIG_MERGE_WILLNEED_WINDOW ahead of the merge cursors
+ *   COLD     - the ranges a stage is done with go to the inactive list
+ *   PAGEOUT  - and are reclaimed at once */
+enum
+{
+        CONFIG_MAP_POPULATE = 1 << 0,
+        CONFIG_MAP_HUGEPAGE = 1 << 1,
+        CONFIG_MAP_WILLNEED = 1 << 2,
+        CONFIG_MAP_COLD     = 1 << 3,
+        CONFIG_MAP_PAGEOUT  = 1 << 4
+};
+
+/* The C++ and stdio streams are double buffered, a pool of background I/O
+ * threads, up to one per hardware thread, reads ahead and writes behind for
+ * all of them */
 constexpr auto CONFIG_USE_CPP_STREAMS = config::ON;
 
+/* Without mmap the runs are read and written through io_uring (Linux only):
+ * every stream keeps CONFIG_URING_BUFFERS reads in flight, the writes are
+ * submitted asynchronously, takes over CONFIG_USE_CPP_STREAMS */
+constexpr auto CONFIG_USE_URING = config::ON;
+
+constexpr unsigned CONFIG_URING_BUFFERS = 3;
+
+/* Strict memory mode for shared hosts: the io_uring streams open the runs
+ * with O_DIRECT and the sorting stage reads its chunks into private buffers
+ * instead of mapping the input, so neither the page cache nor RSS grow
+ * past CONFIG_MEM_AVAIL. Needs CONFIG_USE_URING without CONFIG_USE_MMAP */
+constexpr auto CONFIG_USE_DIRECT_IO = config::OFF;
+
+/* The file streams encode the spilled runs (chunk/run_codec.hpp): sorted
+ * integers are stored as bit-packed deltas, which cuts the merge I/O for a
+ * bit of CPU. The result is written as is. No effect with CONFIG_USE_MMAP */
+constexpr auto CONFIG_RUN_CODEC = config::OFF;
+
+/* The runs spilled to CONFIG_CHUNK_DIRS end with a footer
+ * (chunk/run_footer.hpp): the count, the bounds, the codec and a checksum
+ * of every 16K values with the first value of each block (run_index). The
+ * merges verify the runs as they read them, so a damaged run fails the
+ * merge instead of corrupting the result */
+constexpr auto CONFIG_RUN_FOOTER = config::ON;
+
+/* Non-destructive sort: the input is opened read-only and every chunk is
+ * mapped copy-on-write (MAP_PRIVATE), so it's sorted in private memory and
+ * saved to CONFIG_CHUNK_DIRS as a run, the input isn't written back */
+constexpr auto CONFIG_KEEP_INPUT = config::OFF;
+
+/* Keeps the peak disk use near the input size: the merge inputs are punched
+ * out of their files (FALLOC_FL_PUNCH_HOLE, MADV_REMOVE) as the cursor goes
+ * and the mapped outputs are allocated as they're written instead of up
+ * front, CONFIG_PUNCH_HOLES_STEP at a time. The runs kept in place are
+ * punched out of the input file, except for the ping-pong merge which
+ * writes them back there */
+constexpr auto CONFIG_PUNCH_HOLES = config::OFF;
+
+constexpr size_t CONFIG_PUNCH_HOLES_STEP = 32_MiB;
+
+/* Write the mmap output with non-temporal stores so multi-GB output doesn't
+ * evict the merge heap and the input buffers from the cache. Off until the
+ * LLC misses logged for every merge show a win on the target machine */
+constexpr auto CONFIG_OUTPUT_NT_STORE = config::OFF;
+
+/* The mmapped outputs are written back CONFIG_OUTPUT_WRITEBACK_STEP at a
+ * time as they are filled (sync_file_range) instead of in one burst at
+ * munmap, 0 - disabled. With CONFIG_OUTPUT_WRITEBACK_WAIT the merge waits
+ * for the step before the last one, so there are two steps dirty at most.
+ * The ping-pong levels but the last one are left to the kernel, they are
+ * read back right away */
+constexpr size_t CONFIG_OUTPUT_WRITEBACK_STEP = 16_MiB;
+
+constexpr auto CONFIG_OUTPUT_WRITEBACK_WAIT = config::ON;
+
 /******************************************************************************
 * SORT SECTION
 *****************************************************************************/
@@ -105,17 +186,116 @@ enum
 
 constexpr int CONFIG_SORT_ALGO = CONFIG_SORT_RADIX;
 
+/* A run that is spilled to CONFIG_CHUNK_DIRS is sorted as sub-chunks small
+ * enough for the radix sort to stay in L2/L3, the sub-chunks are merged
+ * into the run file while it's written. Only a sub-chunk is locked at a
+ * time, so the runs may be larger than the memory per thread */
+constexpr auto CONFIG_SORT_COALESCE_RUNS = config::ON;
+
+constexpr size_t CONFIG_SORT_SUBCHUNK_SIZE = 4_MiB;
+
+/* max number of sub-chunks merged into one run */
+constexpr size_t CONFIG_SORT_COALESCE_FAN_IN = 16;
+
+/* CONFIG_MAP_* for the chunks being sorted */
+constexpr unsigned CONFIG_SORT_MAP_POLICY = 0;
+
+/* How a sub-chunk is made resident before it's sorted:
+ *   LOCK     - mlock, falls back to PREFAULT where RLIMIT_MEMLOCK is too low
+ *   PREFAULT - faulted in for writing (MADV_POPULATE_WRITE, read touches on
+ *              the old kernels), the next sub-chunk is faulted in by the I/O
+ *              worker while the current one is sorted
+ *   NONE     - faulted in by the sort itself */
+enum
+{
+        CONFIG_SORT_RESIDENT_NONE,
+        CONFIG_SORT_RESIDENT_LOCK,
+        CONFIG_SORT_RESIDENT_PREFAULT
+};
+
+constexpr int CONFIG_SORT_RESIDENT = CONFIG_SORT_RESIDENT_PREFAULT;
+
 /******************************************************************************
 * MERGE SECTION
 *****************************************************************************/
 
 constexpr auto CONFIG_N_WAY_FLAT = config::ON;
 
+/* With the mmap streams and CONFIG_N_WAY_FLAT off the tree levels are
+ * merged back and forth between the input and the output files, no runs are
+ * saved to CONFIG_CHUNK_DIRS. The fan-in is raised to make the number of
+ * levels odd, so the last one ends up in the output. Adjacent runs are
+ * merged, CONFIG_MERGE_PLAN doesn't apply. The two levels of
+ * CONFIG_TREE_HEIGH 2 become one flat merge, the files only alternate with
+ * three levels or more: CONFIG_TREE_HEIGH 3 or a small CONFIG_N_WAY_MERGE_N */
+constexpr auto CONFIG_MERGE_PINGPONG = config::ON;
+
+/* With the mmap streams in the flat or the ping-pong mode the sorted chunks
+ * stay in the input file and are merged right from there, otherwise every
+ * chunk is saved to CONFIG_CHUNK_DIRS as a run */
+constexpr auto CONFIG_INPLACE_RUNS = config::conflicts_with(
+        CONFIG_KEEP_INPUT,
+        CONFIG_USE_MMAP && (CONFIG_N_WAY_FLAT || CONFIG_MERGE_PINGPONG));
+
+/* The runs spilled to CONFIG_CHUNK_DIRS and the merges of the task tree are
+ * recorded in CONFIG_CHUNK_DIRS[0]/manifest as they complete
+ * (chunk/run_manifest.hpp), a job restarted after a crash goes on from the
+ * first incomplete task. The kept runs are read once on restart and checked
+ * against the block checksums of their footers.
+ * The runs kept in place are overwritten by the merge and the punched ones
+ * can't be merged again, neither can be resumed */
+constexpr auto CONFIG_CHECKPOINT = config::conflicts_with(
+        CONFIG_INPLACE_RUNS || CONFIG_PUNCH_HOLES, CONFIG_RUN_FOOTER);
+
+/* The manifest knows the input by its contents, so a job with a checkpoint
+ * sorts the chunks in private memory as CONFIG_KEEP_INPUT does */
+constexpr auto CONFIG_INPUT_INTACT = CONFIG_KEEP_INPUT || CONFIG_CHECKPOINT;
+
 /* 0 - auto, n > 2 = n */
 constexpr int CONFIG_N_WAY_MERGE_N = 0;
 
 constexpr int CONFIG_TREE_HEIGH = 2;
 
+enum
+{
+        /* runs are grouped in the order they were sorted */
+        CONFIG_MERGE_PLAN_ORDERED,
+        /* the smallest runs are merged first (Huffman-like tree) */
+        CONFIG_MERGE_PLAN_OPTIMAL
+};
+
+constexpr int CONFIG_MERGE_PLAN = CONFIG_MERGE_PLAN_OPTIMAL;
+
+/* Integer keys up to 32 bits are merged through a heap of the keys packed
+ * with the run index into one uint64 instead of the heap of (value, run)
+ * pairs, compare the LLC misses logged for every merge to choose */
+constexpr auto CONFIG_MERGE_PACKED_HEAP = config::ON;
+
+/* After a run wins this number of times in a row the merge gallops:
+ * finds how far the run stays below the runner-up with exponential and
+ * binary search and copies that span in bulk, 0 - disabled */
+constexpr size_t CONFIG_MERGE_MIN_GALLOP = 7;
+
+/* Bytes to prefetch into the cache ahead of every mmapped merge input,
+ * 0 - disabled */
+constexpr size_t CONFIG_MERGE_PREFETCH_DISTANCE = 512;
+
+/* Bytes of every mmapped merge input the kernel is asked to read ahead
+ * (MADV_WILLNEED) one window before the cursor gets there, 0 - disabled.
+ * With CONFIG_MAP_POPULATE the windows are faulted in instead, those of the
+ * mmapped outputs too */
+constexpr size_t CONFIG_MERGE_WILLNEED_WINDOW = 4_MiB;
+
+/* CONFIG_MAP_* for the mmapped merge inputs and outputs */
+constexpr unsigned CONFIG_MERGE_MAP_POLICY = CONFIG_MAP_WILLNEED;
+
+/* The mmapped merge inputs give back the pages behind the cursor in steps
+ * of this size: they are unmapped and go to the inactive list (reclaimed at
+ * once with CONFIG_MAP_PAGEOUT), so a merge keeps about fan-in times the
+ * windows resident instead of its whole input, 0 - the pages are kept until
+ * the input is done */
+constexpr size_t CONFIG_MERGE_DROP_BEHIND = 32_MiB;
+
 /******************************************************************************
 * MEMORY SECTION
 *****************************************************************************/
@@ -77,8 +77,16 @@
 #include "pipeline/pipeline_controller.hpp"
 #include "log.hpp"
 #include "extra/hasher.hpp"
+#include "chunk/chunk_dirs.hpp"
 #include "chunk/chunk_istream.hpp"
 
+/* the result is always read through a mapping */
+template<typename T>
+using result_istream = _chunk_istream<T, chunk_stream_mmap>;
+
+template<typename T>
+using result_istream_iterator = chunk_istream_iterator<T, chunk_stream_mmap>;
+
 float solve_merge_n_eq2(float a, float c)
 {
         if(c < 2.0)
@@ -113,7 +121,7 @@ void check_result(uint64_t isz)
         {
                 auto file = mapped_file::create();
                 file->open(CONFIG_OUTPUT_FILENAME, std::ios::in);
-                chunk_istream<CONFIG_DATA_TYPE> res_is(file->range(), chunk_id());
+                result_istream<CONFIG_DATA_TYPE> res_is(file->range(), chunk_id());
 
                 uint64_t sz = res_is.size();
                 if (isz == sz)
@@ -125,7 +133,7 @@ void check_result(uint64_t isz)
 
                 info() << "Checking is file sorted...";
 
-                chunk_istream_iterator<CONFIG_DATA_TYPE> beg(res_is), end;
+                result_istream_iterator<CONFIG_DATA_TYPE> beg(res_is), end;
                 if (std::is_sorted(beg, end))
                         info() << "File is sorted";
                 else
@@ -150,9 +158,9 @@ void print_result()
 {
         auto file = mapped_file::create();
         file->open(CONFIG_OUTPUT_FILENAME, std::ios::in);
-        chunk_istream<CONFIG_DATA_TYPE> is(file->range(), chunk_id());
+        result_istream<CONFIG_DATA_TYPE> is(file->range(), chunk_id());
 
-        chunk_istream_iterator<CONFIG_DATA_TYPE> beg(is), end;
+        result_istream_iterator<CONFIG_DATA_TYPE> beg(is), end;
 
         std::stringstream ss;
 
@@ -254,8 +262,182 @@ void make_test_file()
 
 void init_enviroment()
 {
-        if (!check_dir_exist(CONFIG_CHUNK_DIR))
-                create_directory(CONFIG_CHUNK_DIR);
+        chunk_dirs::instance().create();
+}
+
+/* Merges already sorted files into the output file like `sort -m`,
+ * the sorting stage is skipped entirely and each input is checked
+ * to be sorted while it's being read */
+template<typename T>
+void merge_only(const std::vector<std::string>& filenames)
+{
+        using merge_task = chunk_merge_task<T, chunk_stream_mmap>;
+
+        std::vector<mapped_file_uptr> files;
+        std::vector<typename merge_task::istream_type> inputs;
+        uint64_t output_size = 0;
+
+        for (chunk_id::id_t i = 0; i < filenames.size(); ++i)
+        {
+                const char* filename = filenames[i].c_str();
+
+                if (file_size(filename) == 0)
+                {
+                        info() << "Skipping empty input " << quote(filename);
+                        continue;
+                }
+
+                auto file = mapped_file::create();
+                file->open(filename, std::ios::in);
+
+                chunk_id id(0, i);
+                typename merge_task::istream_type is(file->range(), id);
+                is.check_order(true);
+
+                info() << "Input " << id << ": " << quote(filename)
+                       << " (" << size_format(is.size()) << ")";
+
+                output_size += is.size();
+                inputs.push_back(std::move(is));
+                files.push_back(std::move(file));
+        }
+
+        if (inputs.empty())
+                THROW_EXCEPTION << "Nothing to merge, all inputs are empty";
+
+        info() << "Output Filename: " << CONFIG_OUTPUT_FILENAME;
+        info() << "Output Filesize: " << size_format(output_size);
+        info() << "K-way Merge Size: " << inputs.size();
+
+        auto output_file = mapped_file::create();
+        output_file->open(CONFIG_OUTPUT_FILENAME, output_size,
+                          std::ios::out | std::ios::trunc);
+
+        typename merge_task::ostream_type os(std::move(output_file));
+        merge_task task(std::move(inputs), std::move(os));
+
+        auto mem_avail = CONFIG_MEM_AVAIL;
+        auto in_buff_size = static_cast<size_t>(mem_avail * CONFIG_IO_BUFF_RATIO);
+        auto out_buff_size = static_cast<size_t>(mem_avail
+                                                 * (1.0f - CONFIG_IO_BUFF_RATIO));
+
+        perf_timer("Merging stage", [&]()
+        {
+                task.execute(in_buff_size, out_buff_size);
+        });
+
+        info2() << task.debug_str();
+}
+
+/* Sorts a stream, `external_sort - < input > output`. The threads read the
+ * chunks of the input in turn into private memory, sort them and save them
+ * to CONFIG_CHUNK_DIRS as runs, then all the runs are merged straight to the
+ * output stream. Neither of the streams has to be a file, the input isn't
+ * staged on disk */
+template<typename T>
+void sort_stream(int in_fd, int out_fd)
+{
+        uint32_t threads_n = (uint32_t)get_thread_number();
+        std::size_t chunk_size = std::max<std::size_t>(
+                round_down(CONFIG_MEM_AVAIL / threads_n, PAGE_SIZE), PAGE_SIZE);
+
+        info() << "Input: stream";
+        info() << "Output: stream";
+        info() << "Threads : " << threads_n;
+        info() << "MEM Available: " << size_format(CONFIG_MEM_AVAIL);
+        info() << "L0 Chunk Size: " << size_format(chunk_size);
+
+        std::mutex lock;
+        bool eof = false;
+        chunk_id::id_t next_id = 0;
+        std::vector<chunk_id> runs;
+        uint64_t input_size = 0;
+
+        thread_management_unit thrmu(threads_n);
+
+        perf_timer("Sorting stage", [&]()
+        {
+                thrmu.spawn_and_join([&](uint32_t)
+                {
+                        auto buffer = mapped_range::create_anonymous(chunk_size);
+
+                        std::unique_lock<std::mutex> lk(lock);
+
+                        /* the stream is read by one thread at a time while
+                         * the others sort */
+                        while (!eof)
+                        {
+                                std::size_t size = stream_read(in_fd,
+                                                               buffer->data(),
+                                                               chunk_size);
+                                eof = size < chunk_size;
+
+                                if (size % sizeof(T))
+                                        THROW_EXCEPTION
+                                                << "Input is broken, the size "
+                                                << "must be a product of "
+                                                << sizeof(T);
+
+                                if (size == 0)
+                                        break;
+
+                                chunk_id id(0, next_id++);
+
+                                lk.unlock();
+
+                                chunk_sort_task<T> task(buffer->range(0, size),
+                                                        id);
+                                task.execute();
+                                task.template save_to<chunk_stream_mmap>(
+                                        id.to_full_filename());
+                                chunk_dirs::instance().written(id, size);
+
+                                lk.lock();
+
+                                runs.push_back(id);
+                                input_size += size;
+                        }
+                });
+        });
+
+        info() << "Input Size: " << size_format(input_size);
+        info() << "L0 Chunk Count: " << num_format(runs.size());
+
+        if (runs.empty())
+                return;
+
+        using merge_task = chunk_merge_task<T, chunk_stream_mmap,
+                                            chunk_stream_fd>;
+
+        std::sort(runs.begin(), runs.end(),
+                  [](const chunk_id& a, const chunk_id& b) {
+                          return a.id < b.id;
+                  });
+
+        std::vector<typename merge_task::istream_type> inputs;
+
+        for (auto& id : runs)
+        {
+                inputs.emplace_back(id);
+                inputs.back().punch_holes(IS_ENABLED(CONFIG_PUNCH_HOLES));
+        }
+
+        typename merge_task::ostream_type os(out_fd);
+        merge_task task(std::move(inputs), std::move(os));
+
+        auto out_buff_size = static_cast<size_t>(CONFIG_MEM_AVAIL
+                                                 * (1.0f - CONFIG_IO_BUFF_RATIO));
+
+        perf_timer("Merging stage", [&]()
+        {
+                task.execute(CONFIG_MEM_AVAIL - out_buff_size, out_buff_size);
+        });
+
+        for (auto& input : task.input_sizes())
+                chunk_dirs::instance().read(input.first, input.second);
+
+        info2() << task.debug_str();
+        chunk_dirs::instance().log_stats();
 }
 
 int main(int argc, char** argv)
@@ -263,6 +445,13 @@ try
 {
         using data_t = CONFIG_DATA_TYPE;
 
+        /* external_sort - : the data goes to stdout, so does the log
+         * unless it's moved to stderr */
+        const bool streaming = argc > 1 && std::strcmp(argv[1], "-") == 0;
+
+        if (streaming)
+                std::cout.rdbuf(std::cerr.rdbuf());
+
         logging::logger::enable_file_logging("external_sort.log");
 
         info() << "Execution path: " << argv[0];
@@ -271,6 +460,27 @@ try
 
         init_enviroment();
 
+        /* external_sort -m file1 file2 ... */
+        if (argc > 2 && std::strcmp(argv[1], "-m") == 0)
+        {
+                std::vector<std::string> filenames(argv + 2, argv + argc);
+
+                perf_timer("Finished for", [&filenames]() {
+                        merge_only<data_t>(filenames);
+                });
+
+                return EXIT_SUCCESS;
+        }
+
+        if (streaming)
+        {
+                perf_timer("Finished for", []() {
+                        sort_stream<data_t>(fileno(stdin), fileno(stdout));
+                });
+
+                return EXIT_SUCCESS;
+        }
+
         std::string input_filename = CONFIG_INPUT_FILENAME;
 
         if (IS_ENABLED(CONFIG_GENERATE_TEST_FILE))
@@ -280,12 +490,29 @@ try
         else if (argc > 1)
                 input_filename = argv[1];
 
+        /* the chunks are sorted in place only if the input is given away */
+        auto input_mode = IS_ENABLED(CONFIG_INPUT_INTACT) || _use_direct_io
+                ? std::ios::in
+                : std::ios::in | std::ios::out;
+
         auto input_file = mapped_file::create();
-        input_file->open(input_filename.c_str(), std::ios::in | std::ios::out);
+        input_file->open(input_filename.c_str(), input_mode);
+
+        /* the ping-pong merge writes the output through the ranges of it,
+         * they can't allocate it as they go */
+        bool sparse_output = IS_ENABLED(CONFIG_PUNCH_HOLES)
+                && !(IS_ENABLED(CONFIG_INPLACE_RUNS)
+                     && !IS_ENABLED(CONFIG_N_WAY_FLAT));
 
         auto output_file = mapped_file::create();
-        output_file->open(CONFIG_OUTPUT_FILENAME, input_file->size(),
-                         std::ios::out | std::ios::trunc);
+
+        if (sparse_output)
+                output_file->open_sparse(CONFIG_OUTPUT_FILENAME,
+                                         input_file->size(),
+                                         std::ios::out | std::ios::trunc);
+        else
+                output_file->open(CONFIG_OUTPUT_FILENAME, input_file->size(),
+                                  std::ios::out | std::ios::trunc);
 
         size_t threads_n = get_thread_number();
 
@@ -298,6 +525,39 @@ try
         if(mem_avail >= input_filesize)
                 l0_chunk_size = input_filesize / (threads_n * 2);
 
+        uint64_t sub_chunk_size = 0;
+
+        /* the direct reads start at the page boundaries */
+        if (_use_direct_io)
+                l0_chunk_size = std::max<uint64_t>(
+                        round_down(l0_chunk_size, PAGE_SIZE), PAGE_SIZE);
+
+        /* with direct I/O or a private chunk the whole chunk is in memory
+         * anyway */
+        if (IS_ENABLED(CONFIG_SORT_COALESCE_RUNS)
+            && !IS_ENABLED(CONFIG_INPLACE_RUNS) && !_use_direct_io
+            && !IS_ENABLED(CONFIG_INPUT_INTACT))
+        {
+                /* only a sub-chunk is locked while sorted, so the run grows
+                 * up to the fan-in of sub-chunks, but each thread still
+                 * gets a run to sort */
+                uint64_t sub_size = std::min<uint64_t>(l0_chunk_size,
+                                                CONFIG_SORT_SUBCHUNK_SIZE);
+
+                uint64_t run_size = std::min<uint64_t>(
+                        sub_size * CONFIG_SORT_COALESCE_FAN_IN,
+                        div_up(input_filesize, threads_n));
+
+                /* the in-memory merge only pays off by making less runs */
+                if (run_size > l0_chunk_size)
+                {
+                        sub_size = div_up(run_size, CONFIG_SORT_COALESCE_FAN_IN);
+
+                        l0_chunk_size = round_up(run_size, sizeof(data_t));
+                        sub_chunk_size = round_up(sub_size, sizeof(data_t));
+                }
+        }
+
         uint64_t chunk_number   = input_filesize / l0_chunk_size;
         uint32_t merge_n = get_nway_merge_n(chunk_number);
 
@@ -326,6 +586,15 @@ try
         info() << "L0 Chunk Size: " << size_format(l0_chunk_size);
         info() << "L0 Chunk Count: " << num_format(chunk_number);
 
+        if (_use_direct_io)
+                info() << "Direct I/O Enabled";
+
+        if (IS_ENABLED(CONFIG_INPUT_INTACT))
+                info() << "Input is kept intact";
+
+        if (sub_chunk_size != 0)
+                info() << "L0 Sub-chunk Size: " << size_format(sub_chunk_size);
+
         /*check constrains */
         if (input_buff_size < sizeof(data_t))
                 THROW_EXCEPTION << "Input buffer size is too small = " 
@@ -339,7 +608,7 @@ try
         pipeline_controller<data_t> controller(
                               std::move(input_file),
                               std::move(output_file),
-                              l0_chunk_size, merge_n, 
+                              l0_chunk_size, sub_chunk_size, merge_n, 
                               (uint32_t)threads_n, 
                               mem_avail, 
                               io_ratio
@@ -73,10 +73,16 @@ public:
 
                 tmu().build_merge_queue();
 
+                auto faults = page_faults::now();
+                cache_misses misses;
+
                 perf_timer("Merging stage is done for", [this]() 
                 {
                         merge_unit().run(lock_, tmu(), thrmu(), mmu());
                 });
+
+                info2() << "Thread merging stage: "
+                        << page_faults::now() - faults << ", " << misses;
         }
 
         thread_management_unit& thrmu() {return thrmu_; }
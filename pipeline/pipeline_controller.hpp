@@ -11,13 +11,15 @@ public:
                 mapped_file_uptr&& input_file,
                 mapped_file_uptr&& output_file,
                 size_t max_chunk_size,
+                size_t sub_chunk_size,
                 size_t n_way_merge, uint32_t threads_n,
                 size_t mem_avail, float io_ratio)
                 : max_chunk_size_(round_down(max_chunk_size, sizeof(T))),
                 n_way_merge_(n_way_merge),
                 threads_n_(threads_n),
                 thrmu_(threads_n_),
-                tmu_(std::move(input_file), std::move(output_file), max_chunk_size_, n_way_merge_),
+                tmu_(std::move(input_file), std::move(output_file), max_chunk_size_,
+                     round_down(sub_chunk_size, sizeof(T)), n_way_merge_),
                 mmu_(mem_avail, threads_n_, io_ratio)
 
         {
@@ -29,6 +31,9 @@ public:
                         pipeline<T> pl(id, thrmu_, tmu_, mmu_);
                         pl.run();
                 });
+
+                tmu_.log_merge_io();
+                tmu_.finish();
         }
 
 private:
@@ -19,6 +19,7 @@ public:
 
                 auto lock = thrmu.get_lock(std::defer_lock);
 
+                auto faults = page_faults::now();
                 ltm.start();
 
                 auto task = _next_task(lock, tmu);
@@ -34,7 +35,8 @@ public:
                 ltm.end();
 
                 info2() << "Thread sorting stage is done for "
-                        << ltm.elapsed<perf_timer::ms>() << " ms";
+                        << ltm.elapsed<perf_timer::ms>() << " ms, "
+                        << page_faults::now() - faults;
         }
 
 private:
@@ -2,6 +2,8 @@
 #include <atomic>
 #include <mutex>
 #include <list>
+#include <map>
+#include "../chunk/chunk_dirs.hpp"
 #include "../chunk/chunk_id.hpp"
 #include "../log.hpp"
 #include "../task.hpp"
@@ -15,53 +17,99 @@ public:
         explicit task_management_unit(mapped_file_uptr&& input_file,
                                       mapped_file_uptr&& output_file, 
                                       size_t max_chunk_size,
+                                      size_t sub_chunk_size,
                                       size_t n_way_merge
         )        : input_file_(std::move(input_file)),
                    input_size_(input_file_->size()),
+                   input_range_(input_file_->range()),
                    output_file_(std::move(output_file)),
                    gpos_(0),
                    max_chunk_size_(max_chunk_size),
+                   sub_chunk_size_(sub_chunk_size),
                    n_way_merge_(n_way_merge),
                    active_tasks_(0)
         {
+                if (checkpoint::value)
+                        manifest_.open(run_manifest::job{
+                                input_file_->filename(), input_size_,
+                                max_chunk_size_, sub_chunk_size_,
+                                n_way_merge_, sizeof(T) });
         }
 
         chunk_sort_task<T>
-        next_sorting_task(std::unique_lock<std::mutex>&)
+        next_sorting_task(std::unique_lock<std::mutex>& lock)
         {
-                static std::atomic<int> id(0);
+                std::size_t offset, chunk_size;
+                chunk_id new_id;
 
-                //unique_guard<std::mutex> lk(lock);
-
-                chunk_id new_id(0, id++);
-
-                std::size_t remained = input_size_ - gpos_.load(std::memory_order_acquire);
-                if (remained == 0)
+                /* the id follows the place of the chunk in the input, a
+                 * restarted job finds its run by it */
+                do
                 {
-                        return chunk_sort_task<T>();
+                        std::size_t pos = gpos_.load(std::memory_order_acquire);
+
+                        do
+                        {
+                                if (pos == input_size_)
+                                        return chunk_sort_task<T>();
+
+                                chunk_size = std::min(input_size_ - pos,
+                                                      max_chunk_size_);
+                        }
+                        while (!gpos_.compare_exchange_weak(pos,
+                                        pos + chunk_size,
+                                        std::memory_order_acq_rel));
+
+                        offset = pos;
+                        new_id = chunk_id(0, (chunk_id::id_t)(offset
+                                                    / max_chunk_size_));
                 }
+                while (_resume(lock, new_id, chunk_size));
+
+                mapped_range_uptr chunk_range;
+
+                if (_use_direct_io)
+                        chunk_range = read_chunk(offset, chunk_size);
+                else if (IS_ENABLED(CONFIG_INPUT_INTACT))
+                        chunk_range = input_file_->private_range(offset,
+                                                                 chunk_size);
+                else
+                        chunk_range = input_file_->range(offset, chunk_size);
+
+                if (!_use_direct_io)
+                        chunk_range->advise_open(CONFIG_SORT_MAP_POLICY, true);
 
-                std::size_t chunk_size = std::min(remained, max_chunk_size_);
+                /* the kernel reads the next chunk while this one is sorted */
+                if (CONFIG_SORT_MAP_POLICY & CONFIG_MAP_WILLNEED
+                    && !_use_direct_io)
+                        input_range_->advise(madvice::willneed,
+                                             offset + chunk_size, chunk_size);
 
-                auto offset = gpos_.fetch_add(chunk_size, std::memory_order_acq_rel);
-                auto chunk_range = input_file_->range(offset, chunk_size);
+                chunk_sort_task<T> task(std::move(chunk_range),
+                                        std::move(new_id), sub_chunk_size_);
 
-                return chunk_sort_task<T>(std::move(chunk_range), std::move(new_id));
+                if (file_backed_chunks::value)
+                        task.close_policy(CONFIG_SORT_MAP_POLICY);
+
+                return task;
         }
 
         void save(std::unique_lock<std::mutex>& lock, chunk_sort_task<T>&& task)
         {
-                unique_guard<std::mutex> lk(lock);
-
-                chunk_istream<T> istream(task.acquire_mapped_mem(), task.id());
-                istreams_.push_back(std::move(istream));
+                save(lock, std::move(task), inplace_runs());
         }
 
         void save(std::unique_ptr<chunk_merge_task<T>> task)
         {
+                if (!inplace_runs::value)
+                        count_scratch_io(*task);
+
                 task->release();
                 --active_tasks_;
 
+                merged_read_size_ += task->read_size();
+                merged_written_size_ += task->written_size();
+
                 info2() << task->debug_str();
 
                 sync_cv_.notify_all();
@@ -70,26 +118,23 @@ public:
         void build_merge_queue()
         {
                 std::call_once(queue_flag_, [this]() {
-                        chunk_ostream<T> ostream(std::move(output_file_));
-                        auto p = new chunk_merge_task<T>(std::move(istreams_), 
-                                                         std::move(ostream));
-                        std::unique_ptr<chunk_merge_task<T>> task(p);
-
-                        queue_.push_back(std::move(task));
+                        build_merge_queue(inplace_runs());
                 });
         }
 
-        void build_merge_queue(std::list<chunk_id>& id_list)
+        void log_merge_io() const
         {
-                std::call_once(queue_flag_, [this, &id_list]() {
-                        debug() << "Building queue...";
+                if (predicted_io_size_ == 0)
+                        return;
 
-                        task_tree<T> tt;
-                        tt.build(id_list, n_way_merge_);
-                        queue_ = tt.make_queue();
+                info() << "Merge I/O predicted: "
+                       << size_format(predicted_io_size_)
+                       << " read / written, actual: "
+                       << size_format(merged_read_size_) << " read / "
+                       << size_format(merged_written_size_) << " written";
 
-                        result_id_ = queue_.back()->id();
-                });
+                if (!inplace_runs::value)
+                        chunk_dirs::instance().log_stats();
         }
 
         size_t merge_queue_size() const { return queue_.size(); }
@@ -135,18 +180,365 @@ public:
         }
 
         chunk_id result_id() const { return result_id_; }
+
+        /* the job is complete, there is nothing to resume */
+        void finish()
+        {
+                if (checkpoint::value)
+                        manifest_.remove();
+        }
+
+        /* The fan-in of every ping-pong level. An odd number of levels ends
+         * in the output, so the fan-in is raised until it's odd: the two
+         * levels of the default CONFIG_TREE_HEIGH become one flat merge and
+         * the files only alternate from three levels on */
+        static std::vector<size_t> pingpong_plan(size_t runs_n, size_t n_way)
+        {
+                size_t lvl_n = merge_levels(runs_n, n_way);
+                if (lvl_n % 2 == 0)
+                        lvl_n = lvl_n ? lvl_n - 1 : 1;
+
+                std::vector<size_t> plan;
+
+                for (size_t lvl = 1; lvl <= lvl_n; ++lvl)
+                {
+                        size_t k = pingpong_fan_in(runs_n, lvl_n - lvl + 1);
+
+                        plan.push_back(k);
+                        runs_n = div_up(runs_n, k);
+                }
+
+                return plan;
+        }
+private:
+        using checkpoint = std::integral_constant<bool,
+                IS_ENABLED(CONFIG_CHECKPOINT)>;
+
+        /* true if the run of the chunk is kept from the previous attempt,
+         * it's counted as written, so the merge outputs are placed to the
+         * same directories as before */
+        bool _resume(std::unique_lock<std::mutex>& lock, const chunk_id& id,
+                     std::size_t size)
+        {
+                if (!checkpoint::value
+                    || !(manifest_.done(id) || manifest_.covers(id)))
+                        return false;
+
+                chunk_dirs::instance().written(id, size);
+
+                unique_guard<std::mutex> lk(lock);
+
+                runs_.push_back(run_info{ id, size });
+
+                return true;
+        }
+
+        /* with direct I/O the chunk is read to private memory, the input
+         * isn't mapped */
+        mapped_range_uptr read_chunk(uint64_t offset, std::size_t size)
+        {
+                auto range = mapped_range::create_anonymous(size);
+
+                range->advise_open(CONFIG_SORT_MAP_POLICY, true);
+
+                file_read_direct(input_file_->filename().c_str(), offset,
+                                 range->data(), size);
+
+                return range;
+        }
+
+        /* the chunks are the pages of the input, not private memory */
+        using file_backed_chunks = std::integral_constant<bool,
+                !_use_direct_io && IS_DISABLED(CONFIG_INPUT_INTACT)>;
+
+        /* the runs saved to CONFIG_CHUNK_DIRS are merged by the task tree */
+        using inplace_runs = std::integral_constant<bool,
+                IS_ENABLED(CONFIG_INPLACE_RUNS)>;
+
+        void save(std::unique_lock<std::mutex>& lock,
+                  chunk_sort_task<T>&& task, std::true_type)
+        {
+                auto range = task.acquire_mapped_mem();
+
+                /* the run stays in place, its fences are taken while the
+                 * sorted chunk is still in the cache */
+                auto index = std::make_shared<run_index<T>>(
+                        run_index<T>::build(
+                                reinterpret_cast<const T*>(range->data()),
+                                range->size() / sizeof(T)));
+
+                range->advise_close(CONFIG_SORT_MAP_POLICY);
+
+                uint64_t offset = static_cast<char*>(range->data())
+                                - static_cast<char*>(input_range_->data());
+
+                unique_guard<std::mutex> lk(lock);
+
+                runs_.push_back(run_info{ task.id(), range->size(), offset });
+                indexes_[task.id()] = std::move(index);
+        }
+
+        void save(std::unique_lock<std::mutex>& lock,
+                  chunk_sort_task<T>&& task, std::false_type)
+        {
+                auto size = task.size();
+                task.save_to(task.id().to_full_filename());
+
+                chunk_dirs::instance().written(task.id(), size);
+
+                if (checkpoint::value)
+                        manifest_.sorted(task.id());
+
+                unique_guard<std::mutex> lk(lock);
+
+                runs_.push_back(run_info{ task.id(), size });
+        }
+
+        /* the result goes to the output file, not to a scratch dir */
+        void count_scratch_io(const chunk_merge_task<T>& task)
+        {
+                auto& dirs = chunk_dirs::instance();
+
+                for (auto& input : task.input_sizes())
+                        dirs.read(input.first, input.second);
+
+                if (!(task.id() == result_id_))
+                        dirs.written(task.id(), task.written_size());
+        }
+
+        void build_merge_queue(std::true_type)
+        {
+                if (!IS_ENABLED(CONFIG_N_WAY_FLAT))
+                {
+                        build_pingpong_queue();
+                        return;
+                }
+
+                std::vector<chunk_istream<T>> istreams;
+
+                for (auto& run : runs_)
+                {
+                        istreams.emplace_back(
+                                input_range_->range(run.offset, run.size),
+                                run.id);
+                        istreams.back().punch_holes(
+                                IS_ENABLED(CONFIG_PUNCH_HOLES));
+                        istreams.back().index(indexes_[run.id]);
+                }
+
+                runs_.clear();
+                indexes_.clear();
+
+                chunk_ostream<T> ostream(std::move(output_file_));
+                auto p = new chunk_merge_task<T>(std::move(istreams), 
+                                                 std::move(ostream));
+                std::unique_ptr<chunk_merge_task<T>> task(p);
+
+                queue_.push_back(std::move(task));
+        }
+
+        /* Every level merges groups of adjacent runs from one file into
+         * the same place of the other one, so the runs of the next level
+         * tile the file again */
+        void build_pingpong_queue()
+        {
+                std::vector<run_info> runs(runs_.begin(), runs_.end());
+                runs_.clear();
+
+                std::sort(runs.begin(), runs.end(),
+                [](const run_info& a, const run_info& b) {
+                        return a.offset < b.offset;
+                });
+
+                /* the fences of the runs of a level, the tasks of the level
+                 * before fill them in as they write the runs */
+                std::vector<run_index_ptr> indexes;
+
+                for (auto& run : runs)
+                        indexes.push_back(std::move(indexes_[run.id]));
+
+                indexes_.clear();
+
+                output_range_ = output_file_->range();
+
+                mapped_range* src = input_range_.get();
+                mapped_range* dst = output_range_.get();
+
+                auto plan = pingpong_plan(runs.size(), n_way_merge_);
+                size_t lvl_n = plan.size();
+
+                for (chunk_id::lvl_t lvl = 1; lvl <= lvl_n; ++lvl)
+                {
+                        size_t k = plan[lvl - 1];
+
+                        std::vector<run_info> next;
+                        std::vector<run_index_ptr> next_indexes;
+
+                        for (size_t i = 0; i < runs.size(); i += k)
+                        {
+                                size_t end = std::min(i + k, runs.size());
+
+                                chunk_id id(lvl, (chunk_id::id_t)next.size());
+                                uint64_t offset = runs[i].offset;
+                                uint64_t size = 0;
+
+                                std::vector<chunk_istream<T>> chunks;
+
+                                for (size_t j = i; j < end; ++j)
+                                {
+                                        chunks.emplace_back(
+                                                src->range(runs[j].offset,
+                                                           runs[j].size),
+                                                runs[j].id);
+                                        chunks.back().index(indexes[j]);
+
+                                        size += runs[j].size;
+                                }
+
+                                chunk_ostream<T> os(dst->range(offset, size));
+
+                                next_indexes.push_back(
+                                        std::make_shared<run_index<T>>());
+                                os.index(next_indexes.back());
+
+                                if (lvl == lvl_n)
+                                        os.writeback(output_file_.get(),
+                                                     offset);
+
+                                queue_.push_back(
+                                std::make_unique<chunk_merge_task<T>>(
+                                        std::move(chunks), std::move(os), id));
+
+                                next.push_back(run_info{ id, size, offset });
+
+                                predicted_io_size_ += size;
+                        }
+
+                        runs = std::move(next);
+                        indexes = std::move(next_indexes);
+                        std::swap(src, dst);
+                }
+
+                if (queue_.empty())
+                        return;
+
+                result_id_ = queue_.back()->id();
+
+                info() << "Merge plan: " << queue_.size() << " tasks, "
+                       << lvl_n << " ping-pong levels, predicted I/O "
+                       << size_format(predicted_io_size_)
+                       << " read / written";
+        }
+
+        /* the smallest fan-in which merges runs_n in lvl_n levels,
+         * a single run is just copied */
+        static size_t pingpong_fan_in(size_t runs_n, size_t lvl_n)
+        {
+                size_t k = 2;
+
+                while (k < runs_n && merge_levels(runs_n, k) > lvl_n)
+                        ++k;
+
+                return std::min(k, std::max<size_t>(runs_n, 1));
+        }
+
+        static size_t merge_levels(size_t runs_n, size_t k)
+        {
+                size_t lvl_n = 0;
+
+                for (; runs_n > 1; ++lvl_n)
+                        runs_n = div_up(runs_n, k);
+
+                return lvl_n;
+        }
+
+        void build_merge_queue(std::false_type)
+        {
+                debug() << "Building queue...";
+
+                runs_.sort([](const run_info& a, const run_info& b) {
+                        return a.id.id < b.id.id;
+                });
+
+                /* the flat mode merges all the runs at once */
+                size_t base = IS_ENABLED(CONFIG_N_WAY_FLAT)
+                        ? std::max(n_way_merge_, runs_.size())
+                        : n_way_merge_;
+
+                task_tree<T> tt;
+                tt.build(runs_, base);
+
+                if (checkpoint::value)
+                {
+                        size_t kept = tt.prune(manifest_);
+
+                        if (kept)
+                                info() << "Resuming, " << kept
+                                       << " merges are kept";
+                }
+
+                chunk_dirs::instance().freeze();
+
+                queue_ = tt.make_queue();
+
+                /* the result isn't a run */
+                if (checkpoint::value)
+                        for (auto& task : queue_)
+                                if (task != queue_.back())
+                                        task->manifest(&manifest_);
+
+                predicted_io_size_ = tt.predicted_io_size();
+                result_id_ = queue_.back()->id();
+
+                queue_.back()->output(make_result_ostream(
+                        std::is_same<chunk_stream_type, chunk_stream_mmap>()));
+
+                info() << "Merge plan: " << queue_.size() << " tasks, "
+                       << result_id_.lvl << " levels, predicted I/O "
+                       << size_format(predicted_io_size_)
+                       << " read / written";
+        }
+
+        chunk_ostream<T> make_result_ostream(std::true_type)
+        {
+                return chunk_ostream<T>(std::move(output_file_));
+        }
+
+        chunk_ostream<T> make_result_ostream(std::false_type)
+        {
+                output_file_.reset();
+
+                chunk_ostream<T> os{ std::string(CONFIG_OUTPUT_FILENAME) };
+                raw_output(os);
+
+                return os;
+        }
+
 private:
         std::condition_variable sync_cv_;
         std::unique_ptr<mapped_file> input_file_;
         const std::size_t input_size_;
+        mapped_range_uptr input_range_;
         mapped_file_uptr output_file_;
+        mapped_range_uptr output_range_;
 
         std::atomic<uint64_t> gpos_;
 
         const size_t max_chunk_size_;
+        const size_t sub_chunk_size_;
         const size_t n_way_merge_;
 
-        std::vector<chunk_istream<T>> istreams_;
+        std::list<run_info> runs_;
+        run_manifest manifest_;
+
+        using run_index_ptr = std::shared_ptr<run_index<T>>;
+
+        /* the fences of the runs kept in place */
+        std::map<chunk_id, run_index_ptr> indexes_;
+
+        uint64_t predicted_io_size_ = 0;
+        std::atomic<uint64_t> merged_read_size_{0};
+        std::atomic<uint64_t> merged_written_size_{0};
 
         std::list<std::unique_ptr<chunk_merge_task<T>>> queue_;
         std::once_flag queue_flag_;
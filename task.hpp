@@ -1,13 +1,19 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <functional>
+#include <future>
+#include <type_traits>
 #include <utility>
 #include "tools/file.hpp"
+#include "tools/io_worker.hpp"
 #include "tools/perf_timer.hpp"
 #include "tools/format.hpp"
 #include "chunk/chunk_id.hpp"
 #include "chunk/chunk_istream.hpp"
 #include "chunk/chunk_ostream.hpp"
+#include "chunk/run_manifest.hpp"
 #include "extra/sort.hpp"
 #include "tools/mapped_file.hpp"
 
@@ -17,10 +23,18 @@ class chunk_sort_task
 public:
         chunk_sort_task() = default;
 
+        /* sub_size - if not 0 the range is sorted as sub-chunks of that
+         * size which are merged when the run is saved */
         explicit
-        chunk_sort_task(std::unique_ptr<mapped_range>&& file, chunk_id id)
+        chunk_sort_task(std::unique_ptr<mapped_range>&& file, chunk_id id,
+                        std::size_t sub_size = 0)
                 : range_(std::move(file)), id_(std::move(id))
-        {}
+        {
+                std::size_t size = range_->size();
+
+                sub_size_ = sub_size && sub_size < size ? sub_size : size;
+                sub_n_ = size ? div_up(size, sub_size_) : 0;
+        }
 
         chunk_sort_task(chunk_sort_task&&) noexcept = default;
         chunk_sort_task& operator=(chunk_sort_task&&) noexcept = default;
@@ -30,21 +44,68 @@ public:
                 perf_timer tm;
                 tm.start();
 
-                range_->lock();
-
                 T* data = reinterpret_cast<T*>(range_->data());
                 std::size_t size = range_->size() / sizeof(T);
 
-                sort(data, size);
+                std::shared_ptr<mapped_range> sub;
+                bool locked = false;
+
+                if (sub_n_)
+                {
+                        sub = sub_range(0);
+                        locked = _make_resident(*sub, false);
+                }
+
+                for (std::size_t i = 0; i < sub_n_; ++i)
+                {
+                        std::shared_ptr<mapped_range> next;
+                        std::future<void> prefault;
+
+                        /* the worker faults the next sub-chunk in while
+                         * this one is sorted */
+                        if (i + 1 < sub_n_)
+                        {
+                                next = sub_range(i + 1);
+
+                                if (!locked && CONFIG_SORT_RESIDENT
+                                               != CONFIG_SORT_RESIDENT_NONE)
+                                        prefault = io_worker::instance().post(
+                                                [next]() { next->prefault(); });
+                        }
+
+                        try
+                        {
+                                sort(reinterpret_cast<T*>(sub->data()),
+                                     sub->size() / sizeof(T));
+                        }
+                        catch (...)
+                        {
+                                if (prefault.valid())
+                                        prefault.wait();
+                                throw;
+                        }
+
+                        if (locked)
+                                sub->unlock();
+
+                        bool prefaulted = prefault.valid();
+                        if (prefaulted)
+                                prefault.get();
 
-                range_->unlock();
+                        if (next)
+                                locked = _make_resident(*next, prefaulted);
+
+                        sub = std::move(next);
+                }
 
                 tm.end();
 
                 info2() << "sorted " << id_
                         << " (" << size_format(range_->size())
                         << "/" << num_format(size) << ") for "
-                        << tm.elapsed<perf_timer::ms>() << " ms";
+                        << tm.elapsed<perf_timer::ms>() << " ms"
+                        << (sub_n_ > 1 ? " as " + std::to_string(sub_n_)
+                                         + " sub-chunks" : "");
 
                 if (IS_ENABLED(CONFIG_PRINT_CHUNK_DATA))
                 {
@@ -64,11 +125,64 @@ public:
                 return std::move(range_);
         }
 
+        /* writes the run to the file, merging the sorted sub-chunks, the
+         * run is encoded if StreamType is packed */
+        template<typename StreamType = chunk_stream_type>
+        void save_to(const std::string& filename)
+        {
+                _save_to<StreamType>(filename,
+                                     is_packed_stream<StreamType>());
+        }
+
+        /* CONFIG_MAP_* applied to the range once the run is saved */
+        void close_policy(unsigned policy) { close_policy_ = policy; }
+
         bool empty() const { return !range_; }
 
+        std::size_t size() const { return range_ ? range_->size() : 0; }
+
         chunk_id id() const { return id_; }
 
 private:
+        template<typename StreamType>
+        void _save_to(const std::string& filename, std::false_type);
+
+        template<typename StreamType>
+        void _save_to(const std::string& filename, std::true_type);
+
+        /* the sub-chunk is locked if it may be, otherwise it's faulted in
+         * unless the worker has done it, true if it's locked */
+        bool _make_resident(mapped_range& sub, bool prefaulted)
+        {
+                switch (CONFIG_SORT_RESIDENT)
+                {
+                case CONFIG_SORT_RESIDENT_LOCK:
+                        if (sub.try_lock())
+                                return true;
+                        /* fall through */
+                case CONFIG_SORT_RESIDENT_PREFAULT:
+                        if (!prefaulted)
+                                sub.prefault();
+                        break;
+                }
+
+                return false;
+        }
+
+        void _release()
+        {
+                range_->advise_close(close_policy_);
+                range_.reset();
+        }
+
+        std::unique_ptr<mapped_range> sub_range(std::size_t i)
+        {
+                std::size_t offset = i * sub_size_;
+
+                return range_->range(offset,
+                        std::min(sub_size_, range_->size() - offset));
+        }
+
         void sort(T* data, std::size_t size)
         {
                 switch(CONFIG_SORT_ALGO)
@@ -109,21 +223,39 @@ private:
 private:
         std::unique_ptr<mapped_range> range_;
         chunk_id id_;
+        std::size_t sub_size_ = 0;
+        std::size_t sub_n_ = 0;
+        unsigned close_policy_ = 0;
 };
 
-template<typename T>
+/* OStreamType - the output may be of another kind than the inputs if the
+ * input stream can copy its tail to it */
+template<typename T, typename StreamType = chunk_stream_type,
+         typename OStreamType = StreamType>
 class chunk_merge_task
 {
 public:
+        using istream_type = _chunk_istream<T, StreamType>;
+        using ostream_type = _chunk_ostream<T, OStreamType>;
+
         chunk_merge_task() = default;
 
-        chunk_merge_task(std::vector<chunk_istream<T>>&& input,
-                         chunk_ostream<T>&& output)
+        chunk_merge_task(std::vector<istream_type>&& input,
+                         ostream_type&& output)
                 : input_(std::move(input)),
                   output_(std::move(output))
         {
         }
 
+        chunk_merge_task(std::vector<istream_type>&& input,
+                         ostream_type&& output,
+                         chunk_id output_id)
+                : input_(std::move(input)),
+                  output_(std::move(output)),
+                  output_id_(std::move(output_id))
+        {
+        }
+
         chunk_merge_task(chunk_merge_task&&) = default;
         chunk_merge_task& operator=(chunk_merge_task&&) = default;
 
@@ -132,6 +264,8 @@ public:
                 perf_timer tm;
                 tm.start();
 
+                cache_misses misses;
+
                 if(IS_ENABLED(CONFIG_REMOVE_TMP_FILES))
                         make_remove_queue();
 
@@ -148,10 +282,13 @@ public:
                 uint64_t output_size = 0;
                 for (auto& is : input_)
                 {
-			is.open();
+			is.open(ick_mem);
                         output_size += is.size();
+                        input_sizes_.emplace_back(is.id(), is.size());
                 }
 
+                output_.open(ock_mem, output_size);
+
                 if(CONFIG_INFO_LEVEL >= 2)
                 {
                         ss_ << "Merged { ";
@@ -163,12 +300,34 @@ public:
                 }
 
                 if (input_.size() == 2)
-                        two_way_merge();
-                else
+                        two_way_merge(input_[0], input_[1]);
+                else if (!small_merge(small_merge_k<small_merge_max>()))
                         pq_merge();
 
                 output_.close();
 
+                /* the bytes the streams have really moved */
+                read_size_ = 0;
+
+                for (std::size_t i = 0; i < input_.size(); ++i)
+                {
+                        input_sizes_[i].second = input_[i].bytes_read();
+                        read_size_ += input_sizes_[i].second;
+                }
+
+                written_size_ = output_.bytes_written();
+
+                /* the inputs are removed only once the output is recorded */
+                if (manifest_)
+                {
+                        std::vector<chunk_id> inputs;
+
+                        for (auto& input : input_sizes_)
+                                inputs.push_back(input.first);
+
+                        manifest_->merged(output_id_, inputs);
+                }
+
                 if(IS_ENABLED(CONFIG_REMOVE_TMP_FILES))
                         remove_tmp_files();
 
@@ -178,7 +337,8 @@ public:
 
                         ss_ << " } -> { " << id() << " ("
                             << size_format(output_.buff_size()) << ")"
-                            << " } for " << tm.elapsed<perf_timer::ms>() << " ms";
+                            << " } for " << tm.elapsed<perf_timer::ms>() << " ms, "
+                            << misses;
                 }
 
         }
@@ -187,6 +347,24 @@ public:
 
         chunk_id id() const { return output_id_; }
 
+        /* bytes the merge has read from the inputs and written to the
+         * output, valid after execute() */
+        uint64_t read_size() const { return read_size_; }
+        uint64_t written_size() const { return written_size_; }
+
+        /* the merged runs and the bytes read from them, valid after
+         * execute() */
+        const std::vector<std::pair<chunk_id, uint64_t>>& input_sizes() const
+        {
+                return input_sizes_;
+        }
+
+        /* replaces the output, used to direct the last merge to the result */
+        void output(ostream_type&& os) { output_ = std::move(os); }
+
+        /* the output run is recorded there once it's complete */
+        void manifest(run_manifest* m) { manifest_ = m; }
+
         void release()
         {
                 input_ = decltype(input_)();
@@ -197,8 +375,10 @@ private:
 
         void make_remove_queue()
         {
+                /* sub-chunks coalesced into a run carry the run id */
                 for(auto& is : input_)
-                        remove_que_.push_back(is.id().to_full_filename());
+                        if (!(is.id() == output_id_))
+                                remove_que_.push_back(is.id().to_full_filename());
 
         }
 
@@ -221,7 +401,7 @@ private:
                 }
         }
 
-        void copy_to_output(chunk_istream<T>& is)
+        void copy_to_output(istream_type& is)
         {
                 is.copy_to(output_);
         }
@@ -231,7 +411,7 @@ private:
         struct heap_item
         {
                 T value;                
-                chunk_istream<T>* is;
+                istream_type* is;
 
 
                 friend bool operator!=(const heap_item& a, const heap_item& b)
@@ -251,9 +431,109 @@ private:
         };
 
         void pq_merge()
+        {
+                using packable = std::integral_constant<bool,
+                                IS_ENABLED(CONFIG_MERGE_PACKED_HEAP)
+                                && std::is_integral<T>::value
+                                && sizeof(T) <= sizeof(uint32_t)>;
+
+                pq_merge(packable());
+        }
+
+        void pq_merge(std::true_type)
+        {
+                pq_merge_packed();
+        }
+
+        void pq_merge(std::false_type)
         {
                 pq_merge_std();
         }
+
+        /* Integer keys up to 32 bits are packed with the run index into one
+         * uint64 heap item: (key << 32) | index. It makes the heap half as
+         * large, comparisons become a single integer compare and equal keys
+         * are taken in the order of the runs */
+        using key_t = typename std::make_unsigned<
+                        typename std::conditional<std::is_integral<T>::value,
+                                                  T, uint32_t>::type>::type;
+
+        /* flips the sign bit of signed keys to keep the order unsigned */
+        static constexpr key_t key_bias = std::is_signed<T>::value
+                        ? (key_t)((key_t)1 << (sizeof(T) * 8 - 1))
+                        : (key_t)0;
+
+        static uint64_t pack_item(T v, uint32_t idx)
+        {
+                return ((uint64_t)(key_t)((key_t)v ^ key_bias) << 32) | idx;
+        }
+
+        static T unpack_value(uint64_t item)
+        {
+                return (T)(key_t)((key_t)(item >> 32) ^ key_bias);
+        }
+
+        static uint32_t unpack_index(uint64_t item)
+        {
+                return (uint32_t)item;
+        }
+
+        void pq_merge_packed()
+        {
+                std::greater<uint64_t> cmp;
+                std::vector<uint64_t> heap(input_.size());
+
+                for (uint32_t i = 0; i < input_.size(); ++i)
+                        heap[i] = pack_item(input_[i].value(), i);
+
+                gallop_counter gc;
+
+                std::make_heap(heap.begin(), heap.end(), cmp);
+                while (!heap.empty())
+                {
+                        std::pop_heap(heap.begin(), heap.end(), cmp);
+
+                        uint64_t item = heap.back();
+                        output_.put(unpack_value(item));
+
+                        auto& is = input_[unpack_index(item)];
+                        bool more = is.next();
+
+                        if (more && heap.size() > 1 && gc.won(&is))
+                        {
+                                /* equal keys of a lower run go first */
+                                uint64_t next = heap.front();
+                                more = gallop(is, unpack_value(next),
+                                              unpack_index(item)
+                                              < unpack_index(next));
+                        }
+
+                        if (more)
+                        {
+                                heap.back() = pack_item(is.value(),
+                                                        unpack_index(item));
+                                std::push_heap(heap.begin(), heap.end(), cmp);
+                        }
+                        else
+                        {
+                                is.release();
+                                heap.pop_back();
+                        }
+
+                        if (heap.size() == 1)
+                        {
+                                auto& last = input_[unpack_index(heap.back())];
+
+                                output_.put(unpack_value(heap.back()));
+
+                                if (last.next())
+                                        copy_to_output(last);
+
+                                last.release();
+                                heap.pop_back();
+                        }
+                }
+        }
         
         void pq_merge_std()
         {
@@ -265,6 +545,8 @@ private:
                         heap[i].is = &input_[i];
                 }
 
+                gallop_counter gc;
+
                 std::make_heap(heap.begin(), heap.end());
                 while (!heap.empty())
                 {
@@ -273,7 +555,13 @@ private:
                         T v = heap.back().value;
                         output_.put(v);
 
-                        if (heap.back().is->next())
+                        auto is = heap.back().is;
+                        bool more = is->next();
+
+                        if (more && heap.size() > 1 && gc.won(is))
+                                more = gallop(*is, heap.front().value, false);
+
+                        if (more)
                         {
                                 heap.back().value = heap.back().is->value();
                                 std::push_heap(heap.begin(), heap.end());
@@ -298,18 +586,21 @@ private:
                 }
         }
 
-        void two_way_merge()
+        void two_way_merge(istream_type& is_a, istream_type& is_b)
         {
+                gallop_counter gc;
+
                 for (;;)
                 {
-                        auto a = input_[0].value();
-                        auto b = input_[1].value();
+                        auto a = is_a.value();
+                        auto b = is_b.value();
 
                         if (a < b)
                         {
                                 output_.put(a);
-                                if (!input_[0].next()) {
-                                        copy_to_output(input_[1]);
+                                if (!is_a.next()
+                                    || (gc.won(&is_a) && !gallop(is_a, b, false))) {
+                                        copy_to_output(is_b);
                                         return;
                                 }
 
@@ -317,20 +608,296 @@ private:
                         else if (b <= a)
                         {
                                 output_.put(b);
-                                if (!input_[1].next()) {
-                                        copy_to_output(input_[0]);
+                                if (!is_b.next()
+                                    || (gc.won(&is_b) && !gallop(is_b, a, true))) {
+                                        copy_to_output(is_a);
                                         return;
                                 }
 
                         }
                 }
         }
+
+        /* Galloping works on the spans of the mmapped runs only */
+        static constexpr bool can_gallop = CONFIG_MERGE_MIN_GALLOP > 0
+                && std::is_same<StreamType, chunk_stream_mmap>::value;
+
+        /* counts how many times in a row the same run has won */
+        class gallop_counter
+        {
+        public:
+                /* true when it's time to gallop */
+                bool won(const void* run)
+                {
+                        if (!can_gallop)
+                                return false;
+
+                        streak_ = run == last_ ? streak_ + 1 : 1;
+                        last_ = run;
+
+                        if (streak_ < CONFIG_MERGE_MIN_GALLOP)
+                                return false;
+
+                        streak_ = 0;
+                        return true;
+                }
+
+        private:
+                const void* last_ = nullptr;
+                std::size_t streak_ = 0;
+        };
+
+        /* Copies the elements of the run that are below the runner-up
+         * (or equal to it when inclusive) straight to the output. The span
+         * is found with exponential and then binary search, once it's past
+         * a block the run_index narrows it down to one block. Returns false
+         * if the run is exhausted. */
+        bool gallop(_chunk_istream<T, chunk_stream_mmap>& is,
+                    const T& bound, bool inclusive)
+        {
+                auto data = is.remaining();
+                const T* first = data.begin();
+                std::size_t n = data.size();
+                const run_index<T>* index = is.index();
+
+                auto below = [&bound, inclusive](const T& v) {
+                        return inclusive ? !(bound < v) : v < bound;
+                };
+
+                std::size_t lo = 0, hi = 1;
+                while (hi < n && below(first[hi]))
+                {
+                        lo = hi;
+                        hi *= 2;
+
+                        /* the blocks in between aren't touched, the end of
+                         * the span is past first[lo] */
+                        if (index && hi > run_block_n)
+                        {
+                                auto r = inclusive ? index->upper_range(bound)
+                                                   : index->lower_range(bound);
+                                std::size_t pos = is.position();
+
+                                lo = std::max<uint64_t>(r.first, pos + lo)
+                                        - pos;
+                                hi = r.second - pos;
+                                break;
+                        }
+                }
+
+                hi = std::min(hi, n);
+
+                const T* end = inclusive
+                        ? std::upper_bound(first + lo, first + hi, bound)
+                        : std::lower_bound(first + lo, first + hi, bound);
+
+                std::size_t count = end - first;
+
+                /* the span is verified against the run footer before it
+                 * reaches the output */
+                bool more = is.skip(count);
+
+                output_.write(first, count);
+
+                return more;
+        }
+
+        template<typename Stream>
+        bool gallop(Stream&, const T&, bool)
+        {
+                return true;
+        }
+
+        /* Fan-in up to this number is merged by the unrolled kernels */
+        static constexpr std::size_t small_merge_max = 16;
+
+        template<std::size_t K>
+        using small_merge_k = std::integral_constant<std::size_t, K>;
+
+        template<std::size_t K>
+        using run_heads = std::array<istream_type*, K>;
+
+        /* returns false if there is no kernel for input_.size() */
+        template<std::size_t K>
+        bool small_merge(small_merge_k<K>)
+        {
+                if (input_.size() != K)
+                        return small_merge(small_merge_k<K - 1>());
+
+                run_heads<K> is;
+                for (std::size_t i = 0; i < K; ++i)
+                        is[i] = &input_[i];
+
+                unrolled_merge(is);
+
+                return true;
+        }
+
+        bool small_merge(small_merge_k<2>)
+        {
+                return false;
+        }
+
+        /* K-way merge without a heap, the run heads are kept in a local
+         * array and the minimum is selected with a branch-free linear scan
+         * the compiler unrolls for every K. When a run is exhausted
+         * the rest are merged by the K-1 kernel. */
+        template<std::size_t K>
+        void unrolled_merge(const run_heads<K>& is)
+        {
+                T head[K];
+
+                for (std::size_t i = 0; i < K; ++i)
+                        head[i] = is[i]->value();
+
+                std::size_t m;
+                gallop_counter gc;
+
+                for (;;)
+                {
+                        T min = head[0];
+                        m = 0;
+
+                        for (std::size_t i = 1; i < K; ++i)
+                        {
+                                bool less = head[i] < min;
+
+                                min = less ? head[i] : min;
+                                m = less ? i : m;
+                        }
+
+                        output_.put(min);
+
+                        if (!is[m]->next())
+                                break;
+
+                        if (gc.won(is[m]))
+                        {
+                                /* the lowest index wins the ties */
+                                std::size_t r = m == 0 ? 1 : 0;
+                                for (std::size_t i = r + 1; i < K; ++i)
+                                        if (i != m && head[i] < head[r])
+                                                r = i;
+
+                                if (!gallop(*is[m], head[r], m < r))
+                                        break;
+                        }
+
+                        head[m] = is[m]->value();
+                }
+
+                is[m]->release();
+
+                run_heads<K - 1> rest;
+                for (std::size_t i = 0, j = 0; i < K; ++i)
+                        if (i != m)
+                                rest[j++] = is[i];
+
+                unrolled_merge(rest);
+        }
+
+        void unrolled_merge(const run_heads<2>& is)
+        {
+                two_way_merge(*is[0], *is[1]);
+        }
 private:
-        std::vector<chunk_istream<T>> input_;
-        chunk_ostream<T> output_;
+        std::vector<istream_type> input_;
+        ostream_type output_;
         chunk_id output_id_;
+        uint64_t read_size_ = 0;
+        uint64_t written_size_ = 0;
+        std::vector<std::pair<chunk_id, uint64_t>> input_sizes_;
+        run_manifest* manifest_ = nullptr;
 
         std::stringstream ss_;
 
         std::vector<std::string> remove_que_;
 };
+
+template<typename T>
+template<typename StreamType>
+void chunk_sort_task<T>::_save_to(const std::string& filename, std::false_type)
+{
+        if (sub_n_ <= 1)
+        {
+                if (_use_direct_io)
+                        file_write_direct(filename.c_str(), range_->data(),
+                                          range_->size());
+                else
+                        range_->map_to_new_file(filename.c_str());
+
+                /* the run is written as a whole, it's summed up in one
+                 * pass over the sorted chunk */
+                run_footer_writer<T> footer;
+                footer.add(reinterpret_cast<const T*>(range_->data()),
+                           range_->size() / sizeof(T));
+                footer.write(filename);
+
+                _release();
+
+                return;
+        }
+
+        using merge_task = chunk_merge_task<T, chunk_stream_mmap>;
+
+        std::vector<typename merge_task::istream_type> chunks;
+
+        for (std::size_t i = 0; i < sub_n_; ++i)
+                chunks.emplace_back(sub_range(i), id_);
+
+        typename merge_task::ostream_type os{ std::string(filename) };
+
+        merge_task task(std::move(chunks), std::move(os), id_);
+
+        /* the mmap streams don't use the buffers */
+        task.execute(range_->size(), range_->size());
+        task.release();
+
+        info2() << "coalesced " << sub_n_ << " sub-chunks into " << id_;
+
+        _release();
+}
+
+template<typename T>
+template<typename StreamType>
+void chunk_sort_task<T>::_save_to(const std::string& filename, std::true_type)
+{
+        using ostream_type = _chunk_ostream<T, StreamType>;
+
+        /* the chunk is the memory of the stage, it's encoded through a
+         * small buffer */
+        std::size_t buff_size = std::min<std::size_t>(range_->size(), 1_MiB);
+
+        if (sub_n_ <= 1)
+        {
+                ostream_type os{ std::string(filename) };
+
+                os.open(buff_size, range_->size());
+                os.write(reinterpret_cast<const T*>(range_->data()),
+                         range_->size() / sizeof(T));
+                os.close();
+
+                _release();
+
+                return;
+        }
+
+        using merge_task = chunk_merge_task<T, chunk_stream_mmap, StreamType>;
+
+        std::vector<typename merge_task::istream_type> chunks;
+
+        for (std::size_t i = 0; i < sub_n_; ++i)
+                chunks.emplace_back(sub_range(i), id_);
+
+        ostream_type os{ std::string(filename) };
+
+        merge_task task(std::move(chunks), std::move(os), id_);
+
+        task.execute(range_->size(), buff_size);
+        task.release();
+
+        info2() << "coalesced " << sub_n_ << " sub-chunks into " << id_
+                << " (encoded)";
+
+        _release();
+}
@@ -2,9 +2,22 @@
 
 #include <memory>
 #include <list>
+#include <vector>
+#include <map>
+#include <queue>
 
+#include "chunk/chunk_dirs.hpp"
 #include "task.hpp"
 
+/* sorted run which is an input for the merge tree */
+struct run_info
+{
+        chunk_id id;
+        uint64_t size;
+        /* position in the file for the runs kept in place */
+        uint64_t offset = 0;
+};
+
 template<typename T>
 struct task_tree_node
 {
@@ -12,58 +25,42 @@ struct task_tree_node
 
         std::list<std::unique_ptr<task_tree_node>> childs;
         task_tree_node* parent = nullptr;
+
+        chunk_id id;
+        uint64_t size = 0;
 };
 
 template<typename T>
 class task_tree
 {
+        using node_uptr = std::unique_ptr<task_tree_node<T>>;
 public:
-        void build(std::list<chunk_id>& l0_ids, size_t base)
+        void build(std::list<run_info>& l0_runs, size_t base)
         {
                 base_ = base;
+                io_size_ = 0;
+                lvl_ids_.clear();
 
-                chunk_id::id_t id_idx   = 0;
-                chunk_id::lvl_t lvl_idx = 1;
-
-                std::list<std::unique_ptr<task_tree_node<T>>> nodes;
-
-                while(!l0_ids.empty())
+                switch (CONFIG_MERGE_PLAN)
                 {
-                        size_t q_size = l0_ids.size();
-
-                        size_t n = std::min(base_, q_size);
-
-                        size_t rem = q_size - n;
-                        if(0 < rem && rem < base_)
-                                n += rem;
-
-                        std::list<chunk_id> ids;
-
-                        auto end = l0_ids.begin();
-                        std::advance(end, n);
-
-                        ids.splice(ids.begin(), l0_ids, l0_ids.begin(), end);
+                case CONFIG_MERGE_PLAN_ORDERED:
+                        build_ordered(l0_runs);
+                        break;
 
-                        if(ids.empty())
-                                break;
+                case CONFIG_MERGE_PLAN_OPTIMAL:
+                        build_optimal(l0_runs);
+                        break;
 
-
-                        chunk_id output_id(lvl_idx, id_idx++);
-                        auto task = make_task(std::move(ids), output_id);
-
-                        auto node = std::make_unique<task_tree_node<T>>();
-                        node->task = std::move(task);
-
-                        nodes.push_back(std::move(node));
+                default:
+                        THROW_EXCEPTION << "Unknown merge plan";
                 }
-
-                root_ = std::move(build(std::move(nodes), ++lvl_idx));
         }
 
+        /* tasks ordered by level, every task goes after all its inputs */
         std::list<std::unique_ptr<chunk_merge_task<T>>> make_queue()
         {
-                std::list<std::unique_ptr<task_tree_node<T>>> q;
-                std::list<std::unique_ptr<chunk_merge_task<T>>> q2;
+                std::vector<node_uptr> nodes;
+                std::list<node_uptr> q;
 
                 q.push_back(std::move(root_));
 
@@ -73,30 +70,68 @@ public:
 
                         q.pop_front();
 
-                        q2.push_front(std::move(node->task));
-
                         for(auto& c : node->childs)
                         {
                                 q.push_back(std::move(c));
                         }
+
+                        nodes.push_back(std::move(node));
                 }
 
+                std::stable_sort(nodes.begin(), nodes.end(),
+                [](const node_uptr& a, const node_uptr& b)
+                {
+                        return a->id.lvl != b->id.lvl ? a->id.lvl < b->id.lvl
+                                                      : a->id.id < b->id.id;
+                });
+
+                std::list<std::unique_ptr<chunk_merge_task<T>>> q2;
+
+                for (auto& node : nodes)
+                        if (node->task)
+                                q2.push_back(std::move(node->task));
+
                 return q2;
         }
 
+        /* bytes the whole tree is going to read and to write each */
+        uint64_t predicted_io_size() const { return io_size_; }
+
+        /* Drops the merges which are kept from the previous attempt of the
+         * job along with everything under them, the result is always
+         * merged. Returns the number of the kept merges */
+        size_t prune(const run_manifest& manifest)
+        {
+                size_t kept = 0;
+
+                for (auto& c : root_->childs)
+                        kept += prune(*c, manifest);
+
+                io_size_ = 0;
+                count_io(*root_);
+
+                return kept;
+        }
 
 private:
 
-        std::unique_ptr<task_tree_node<T>>
-        build(std::list<std::unique_ptr<task_tree_node<T>>>&& nodes,
-              chunk_id::lvl_t lvl)
+        /* Groups runs strictly in the list order, the tail groups absorb
+         * the remainder */
+        void build_ordered(std::list<run_info>& l0_runs)
         {
+                std::list<node_uptr> nodes;
+
+                for (auto& run : l0_runs)
+                        nodes.push_back(make_leaf(run));
 
-                if (nodes.size() == 1)
-                        return std::move(nodes.back());
+                l0_runs.clear();
 
-                std::list<std::unique_ptr<task_tree_node<T>>> new_nodes;
-                chunk_id::id_t id = 0;
+                root_ = std::move(build(std::move(nodes)));
+        }
+
+        node_uptr build(std::list<node_uptr>&& nodes)
+        {
+                std::list<node_uptr> new_nodes;
                 while(!nodes.empty())
                 {
                         size_t q_size = nodes.size();
@@ -107,7 +142,7 @@ private:
                         if(0 < rem && rem < base_)
                                 n += rem;
 
-                        std::list<std::unique_ptr<task_tree_node<T>>> childs;
+                        std::list<node_uptr> childs;
 
                         auto end = nodes.begin();
                         std::advance(end, n);
@@ -117,59 +152,172 @@ private:
                         if(childs.empty())
                                 break;
 
-                        chunk_id output_id(lvl, id++);
+                        new_nodes.push_back(make_node(std::move(childs)));
+                }
+
+                if(new_nodes.size() > 1)
+                        return build(std::move(new_nodes));
+                else
+                        return std::move(new_nodes.back());
+        }
 
-                        std::vector<chunk_istream<T>> chunks;
-                        auto new_node = std::make_unique<task_tree_node<T>>();
+        /* Huffman-like merge tree: the smallest runs are always merged
+         * first under the fan-in limit. The first merge takes just enough
+         * runs to make every following one full, which minimizes the total
+         * number of bytes re-read and re-written. */
+        void build_optimal(std::list<run_info>& l0_runs)
+        {
+                struct item
+                {
+                        uint64_t size;
+                        uint64_t seq;
+                        task_tree_node<T>* node;
 
-                        for(auto& node : childs)
+                        bool operator>(const item& o) const
                         {
-                                chunks.emplace_back(node->task->id());
+                                return size != o.size ? size > o.size
+                                                      : seq > o.seq;
+                        }
+                };
+
+                std::priority_queue<item, std::vector<item>,
+                                    std::greater<item>> pq;
+                std::map<task_tree_node<T>*, node_uptr> pending;
+                uint64_t seq = 0;
+
+                auto push = [&](node_uptr node)
+                {
+                        auto p = node.get();
+                        pq.push(item{ p->size, seq++, p });
+                        pending.emplace(p, std::move(node));
+                };
+
+                for (auto& run : l0_runs)
+                        push(make_leaf(run));
+
+                size_t runs_n = l0_runs.size();
+                l0_runs.clear();
 
-                                node->parent = new_node.get();
+                size_t n = runs_n <= base_
+                        ? runs_n
+                        : (runs_n - 2) % (base_ - 1) + 2;
+
+                do
+                {
+                        std::list<node_uptr> childs;
+
+                        for (size_t i = 0; i < n && !pq.empty(); ++i)
+                        {
+                                auto found = pending.find(pq.top().node);
+                                childs.push_back(std::move(found->second));
+                                pending.erase(found);
+                                pq.pop();
                         }
 
-                        std::string name = output_id.to_full_filename();
-                        chunk_ostream<T> os(std::move(name));
+                        push(make_node(std::move(childs)));
 
+                        n = base_;
+                }
+                while (pq.size() > 1);
 
-                        new_node->task = std::make_unique<chunk_merge_task<T>>(
-                                std::move(chunks),
-                                std::move(os),
-                                output_id
-                        );
+                root_ = std::move(pending.begin()->second);
+        }
 
-                        new_node->childs = std::move(childs);
+        size_t prune(task_tree_node<T>& node, const run_manifest& manifest)
+        {
+                if (!node.task)
+                        return 0;
+
+                std::vector<chunk_id> inputs;
+
+                for (auto& c : node.childs)
+                        inputs.push_back(c->id);
+
+                if (manifest.done(node.id, inputs))
+                {
+                        node.task.reset();
+                        node.childs.clear();
 
-                        new_nodes.push_back(std::move(new_node));
+                        return 1;
                 }
 
-                if(new_nodes.size() > 1)
-                        return build(std::move(new_nodes), ++lvl);
-                else
-                        return std::move(new_nodes.back());
+                size_t kept = 0;
+
+                for (auto& c : node.childs)
+                        kept += prune(*c, manifest);
+
+                return kept;
         }
 
+        void count_io(const task_tree_node<T>& node)
+        {
+                if (!node.task)
+                        return;
+
+                io_size_ += node.size;
+
+                for (auto& c : node.childs)
+                        count_io(*c);
+        }
+
+        node_uptr make_leaf(const run_info& run)
+        {
+                auto node = std::make_unique<task_tree_node<T>>();
+                node->id = run.id;
+                node->size = run.size;
+
+                return node;
+        }
 
-        std::unique_ptr<chunk_merge_task<T>> make_task(std::list<chunk_id>&& ids,
-                                                       chunk_id output_id)
+        node_uptr make_node(std::list<node_uptr>&& childs)
         {
+                auto new_node = std::make_unique<task_tree_node<T>>();
+
+                chunk_id::lvl_t lvl = 0;
+                for (auto& node : childs)
+                        lvl = std::max(lvl, node->id.lvl);
+
+                ++lvl;
+
+                chunk_id output_id(lvl, lvl_ids_[lvl]++);
+
                 std::vector<chunk_istream<T>> chunks;
+                std::vector<chunk_id> input_ids;
 
-                for(const chunk_id& id : ids)
+                for(auto& node : childs)
                 {
-                        chunks.emplace_back(id);
+                        chunks.emplace_back(node->id);
+                        chunks.back().punch_holes(
+                                IS_ENABLED(CONFIG_PUNCH_HOLES));
+                        input_ids.push_back(node->id);
+
+                        node->parent = new_node.get();
+                        new_node->size += node->size;
                 }
 
+                chunk_dirs::instance().place(output_id, input_ids,
+                                             new_node->size);
+
                 std::string name = output_id.to_full_filename();
                 chunk_ostream<T> os(std::move(name));
 
-                return std::make_unique<chunk_merge_task<T>>(std::move(chunks),
+                new_node->task = std::make_unique<chunk_merge_task<T>>(
+                        std::move(chunks),
                         std::move(os),
-                        output_id);
+                        output_id
+                );
+
+                new_node->id = output_id;
+                new_node->childs = std::move(childs);
+
+                io_size_ += new_node->size;
+
+                return new_node;
         }
 
 private:
         size_t base_ = 0;
-        std::unique_ptr<task_tree_node<T>> root_;
+        uint64_t io_size_ = 0;
+        std::map<chunk_id::lvl_t, chunk_id::id_t> lvl_ids_;
+        node_uptr root_;
 };
@@ -0,0 +1,159 @@
+/* The packed runs (CONFIG_RUN_CODEC) are decoded from frames whose heads
+ * come from the disk, a damaged head must fail the read and the merge with
+ * an exception instead of overrunning the frame buffer */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../task.hpp"
+#include "../chunk/chunk_dirs.hpp"
+
+using packed_stream = chunk_stream_packed<chunk_stream_stdio>;
+using istream = _chunk_istream<uint32_t, packed_stream>;
+using ostream = _chunk_ostream<uint32_t, packed_stream>;
+using codec = run_codec<uint32_t>;
+
+static constexpr std::size_t buff_size = 64_KiB;
+
+static std::vector<std::string> files;
+
+static int failed = 0;
+
+static void write_run(const chunk_id& id, uint32_t first, std::size_t n)
+{
+        files.push_back(id.to_full_filename());
+
+        ostream os(id.to_full_filename());
+        os.open(buff_size, n * sizeof(uint32_t));
+
+        for (std::size_t i = 0; i < n; ++i)
+                os.put(first + (uint32_t)i * 3);
+
+        os.close();
+}
+
+/* writes a head of 255 values, more than a frame holds, over the head of
+ * the frame-th frame */
+static void break_head(const chunk_id& id, std::size_t frame)
+{
+        FILE* f = fopen(id.to_full_filename().c_str(), "r+b");
+        long offset = sizeof(uint64_t);
+        char head[codec::head_size];
+
+        for (std::size_t i = 0; i <= frame; ++i)
+        {
+                fseek(f, offset, SEEK_SET);
+
+                if (fread(head, 1, sizeof(head), f) != sizeof(head))
+                        THROW_EXCEPTION << "The run has no frame " << i;
+
+                if (i < frame)
+                        offset += codec::frame_size(head);
+        }
+
+        head[0] = (char)0xff;
+        head[1] = 0;
+
+        fseek(f, offset, SEEK_SET);
+        fwrite(head, 1, sizeof(head), f);
+        fclose(f);
+}
+
+static void expect_throw(const char* name, const std::function<void()>& fn)
+{
+        try
+        {
+                fn();
+        }
+        catch (const std::exception& e)
+        {
+                printf("%s: passed, %s\n", name, e.what());
+                return;
+        }
+
+        printf("%s: FAILED, no exception\n", name);
+        ++failed;
+}
+
+static void test_read_broken_head()
+{
+        chunk_id id(0, 0);
+
+        write_run(id, 0, 10000);
+        break_head(id, 0);
+
+        expect_throw("read_broken_head", [&id]()
+        {
+                istream is(id);
+                is.open(buff_size);
+
+                while (is.next())
+                        ;
+        });
+}
+
+static void test_merge_broken_head()
+{
+        std::vector<istream> inputs;
+
+        for (chunk_id::id_t i = 1; i <= 3; ++i)
+        {
+                write_run(chunk_id(0, i), i, 10000);
+                inputs.emplace_back(chunk_id(0, i));
+        }
+
+        /* the merge is well under way when it gets there */
+        break_head(chunk_id(0, 2), 40);
+
+        chunk_id output(1, 0);
+        files.push_back(output.to_full_filename());
+
+        chunk_merge_task<uint32_t, packed_stream> task(
+                std::move(inputs), ostream(output.to_full_filename()),
+                output);
+
+        expect_throw("merge_broken_head", [&task]()
+        {
+                task.execute(3 * buff_size, buff_size);
+        });
+}
+
+int main()
+{
+        char dir[] = "/tmp/packed_run_test.XXXXXX";
+
+        if (!mkdtemp(dir) || chdir(dir) != 0)
+        {
+                perror("Cannot make the test directory");
+                return EXIT_FAILURE;
+        }
+
+        chunk_dirs::instance().create();
+
+        try
+        {
+                test_read_broken_head();
+                test_merge_broken_head();
+        }
+        catch (const std::exception& e)
+        {
+                printf("FAILED: %s\n", e.what());
+                ++failed;
+        }
+
+        for (auto& file : files)
+                unlink(file.c_str());
+
+        for (const char* path : CONFIG_CHUNK_DIRS)
+                rmdir(path);
+
+        if (chdir("/") == 0)
+                rmdir(dir);
+
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,52 @@
+/* The ping-pong merge (CONFIG_MERGE_PINGPONG) raises the fan-in to make the
+ * number of levels odd. The fan-in of CONFIG_TREE_HEIGH 2 collapses to one
+ * flat merge, three levels and more alternate between the files */
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../pipeline/task_management_unit.hpp"
+
+using tmu = task_management_unit<uint32_t>;
+
+static int failed = 0;
+
+static void expect_plan(size_t runs_n, size_t n_way,
+                        const std::vector<size_t>& expected)
+{
+        auto plan = tmu::pingpong_plan(runs_n, n_way);
+
+        printf("%zu runs, fan-in %zu: %zu levels {", runs_n, n_way,
+               plan.size());
+
+        for (auto k : plan)
+                printf(" %zu", k);
+
+        if (plan == expected)
+        {
+                printf(" } passed\n");
+                return;
+        }
+
+        printf(" } FAILED\n");
+        ++failed;
+}
+
+int main()
+{
+        /* the square root fan-in of CONFIG_TREE_HEIGH 2 */
+        expect_plan(16, 4, { 16 });
+        expect_plan(100, 10, { 100 });
+
+        /* three levels: input -> output -> input -> output */
+        expect_plan(8, 2, { 2, 2, 2 });
+        expect_plan(64, 4, { 4, 4, 4 });
+
+        /* four levels are cut to three with a larger fan-in */
+        expect_plan(16, 2, { 3, 3, 2 });
+
+        /* a single run is copied to the output */
+        expect_plan(1, 4, { 1 });
+
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -5,6 +5,7 @@
 #include "../log.hpp"
 #include "raw_file.hpp"
 #include "mapped_file.hpp"
+#include "format.hpp"
 
 #if defined(_WINDOWS)
 
@@ -107,9 +108,33 @@ void create_directory(const char* name)
                 THROW_EXCEPTION << win_error_string()(GetLastError()));
 }
 
+uint64_t file_size(const char* filename)
+{
+        WIN32_FILE_ATTRIBUTE_DATA fad;
+
+        if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &fad))
+                THROW_EXCEPTION << "Cannot get file '" << filename
+                                << "' attributes: "
+                                << win_error_string()(GetLastError());
+
+        return ((uint64_t)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+}
+
+uint64_t file_copy_range(int, uint64_t, int, uint64_t, uint64_t)
+{
+        return 0;
+}
+
+size_t stream_read(int, void*, size_t)
+{
+        THROW_EXCEPTION << "Not implemented";
+}
+
 #else
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -189,8 +214,322 @@ void create_directory(const char* path)
                                 << path << "': " << put_errno;
 }
 
+uint64_t file_size(const char* filename)
+{
+        struct stat sb{};
+
+        if (::stat(filename, &sb) == -1)
+                THROW_FILE_EXCEPTION(filename) << "Cannot get file stat";
+
+        return (uint64_t)sb.st_size;
+}
+
+uint64_t file_copy_range(int fd_in, uint64_t off_in,
+                         int fd_out, uint64_t off_out, uint64_t len)
+{
+#if defined(__linux__)
+        loff_t in = off_in, out = off_out;
+        uint64_t copied = 0;
+
+        while (copied < len)
+        {
+                ssize_t r = ::copy_file_range(fd_in, &in, fd_out, &out,
+                                              len - copied, 0);
+                if (r > 0)
+                {
+                        copied += r;
+                        continue;
+                }
+
+                if (r == -1 && errno == EINTR)
+                        continue;
+
+                /* EOF, or the kernel/fs can't do it (ENOSYS, EXDEV, ...),
+                 * the caller falls back to a user space copy */
+                break;
+        }
+
+        return copied;
+#else
+        return 0;
+#endif
+}
+
+size_t stream_read(int fd, void* data, size_t size)
+{
+        size_t done = 0;
+
+        while (done < size)
+        {
+                ssize_t r = ::read(fd, (char*)data + done, size - done);
+
+                if (r > 0)
+                {
+                        done += r;
+                        continue;
+                }
+
+                if (r == 0)
+                        break;
+
+                if (errno != EINTR)
+                        THROW_EXCEPTION << "Cannot read the stream: "
+                                        << put_errno;
+        }
+
+        return done;
+}
+
 #endif // defined
 
+void aligned_deleter::operator()(char* p) const noexcept
+{
+#if defined(_WIN32)
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+}
+
+aligned_buffer make_aligned_buffer(size_t size, size_t alignment)
+{
+        void* p = nullptr;
+
+#if defined(_WIN32)
+        p = _aligned_malloc(size, alignment);
+#else
+        if (posix_memalign(&p, alignment, size) != 0)
+                p = nullptr;
+#endif
+
+        if (!p)
+                THROW_EXCEPTION << "Cannot allocate " << size_format(size)
+                                << " aligned to " << alignment;
+
+        return aligned_buffer(static_cast<char*>(p));
+}
+
+#if defined(__linux__)
+
+int file_open_direct(const char* filename, int flags)
+{
+        int fd = ::open(filename, flags | O_DIRECT | O_CLOEXEC, 0666);
+
+        if (fd == -1 && errno == EINVAL)
+                fd = ::open(filename, flags | O_CLOEXEC, 0666);
+
+        if (fd == -1)
+                THROW_FILE_EXCEPTION(filename) << "Cannot open the file";
+
+        return fd;
+}
+
+void file_read_direct(const char* filename, uint64_t offset,
+                      void* data, size_t size)
+{
+        int fd = file_open_direct(filename, O_RDONLY);
+        auto p = static_cast<char*>(data);
+
+        for (size_t done = 0; done < size; )
+        {
+                ssize_t r = pread(fd, p + done,
+                                  round_up(size - done, PAGE_SIZE),
+                                  offset + done);
+
+                if (r == -1 && errno == EINTR)
+                        continue;
+
+                if (r <= 0)
+                {
+                        int err = r == 0 ? EIO : errno;
+                        ::close(fd);
+                        errno = err;
+
+                        THROW_FILE_EXCEPTION(filename)
+                                << "Cannot read the file";
+                }
+
+                done += r;
+        }
+
+        ::close(fd);
+}
+
+void file_write_direct(const char* filename, const void* data, size_t size)
+{
+        int fd = file_open_direct(filename, O_WRONLY | O_CREAT | O_TRUNC);
+        auto p = static_cast<const char*>(data);
+
+        /* the tail goes through a zeroed page, the padding is cut off */
+        size_t body = round_down(size, PAGE_SIZE);
+        aligned_buffer tail;
+
+        if (body != size)
+        {
+                tail = make_aligned_buffer(PAGE_SIZE);
+                std::memset(tail.get(), 0, PAGE_SIZE);
+                std::memcpy(tail.get(), p + body, size - body);
+        }
+
+        for (size_t done = 0; done < size; )
+        {
+                const char* src = done < body ? p + done : tail.get();
+                size_t len = done < body ? body - done : PAGE_SIZE;
+
+                ssize_t r = pwrite(fd, src, len, done);
+
+                if (r == -1 && errno == EINTR)
+                        continue;
+
+                if (r <= 0 || (done >= body && (size_t)r != len))
+                {
+                        int err = r == -1 ? errno : EIO;
+                        ::close(fd);
+                        errno = err;
+
+                        THROW_FILE_EXCEPTION(filename)
+                                << "Cannot write the file";
+                }
+
+                done += r;
+        }
+
+        if (body != size && ftruncate(fd, size) == -1)
+        {
+                int err = errno;
+                ::close(fd);
+                errno = err;
+
+                THROW_FILE_EXCEPTION(filename) << "Cannot truncate the file";
+        }
+
+        if (::close(fd) == -1)
+                THROW_FILE_EXCEPTION(filename) << "Cannot close the file";
+}
+
+void hole_puncher::open(const std::string& filename, uint64_t step)
+{
+        close();
+
+        filename_ = filename;
+        step_ = std::max<uint64_t>(round_up(step, PAGE_SIZE), PAGE_SIZE);
+        offset_ = done_ = 0;
+
+        fd_ = ::open(filename.c_str(), O_WRONLY | O_CLOEXEC);
+
+        if (fd_ == -1)
+                THROW_FILE_EXCEPTION(filename) << "Cannot open the file";
+}
+
+void hole_puncher::_punch(uint64_t end)
+{
+        if (end <= done_)
+                return;
+
+        if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      done_, end - done_) == -1)
+        {
+                if (errno != EOPNOTSUPP)
+                        THROW_FILE_EXCEPTION(filename_)
+                                << "Cannot punch a hole at " << done_;
+
+                ::close(fd_);
+                fd_ = -1;
+        }
+
+        done_ = end;
+}
+
+void hole_puncher::close() noexcept
+{
+        if (fd_ == -1)
+                return;
+
+        try
+        {
+                _punch(offset_);
+        }
+        catch (...)
+        {
+        }
+
+        if (fd_ != -1)
+                ::close(fd_);
+
+        fd_ = -1;
+}
+
+#else
+
+void hole_puncher::open(const std::string&, uint64_t)
+{
+}
+
+void hole_puncher::close() noexcept
+{
+}
+
+void hole_puncher::_punch(uint64_t)
+{
+}
+
+int file_open_direct(const char* filename, int)
+{
+        THROW_FILE_EXCEPTION(filename) << "Direct I/O is not supported";
+
+        return -1;
+}
+
+void file_read_direct(const char* filename, uint64_t, void*, size_t)
+{
+        THROW_FILE_EXCEPTION(filename) << "Direct I/O is not supported";
+}
+
+void file_write_direct(const char* filename, const void*, size_t)
+{
+        THROW_FILE_EXCEPTION(filename) << "Direct I/O is not supported";
+}
+
+#endif
+
+hole_puncher::~hole_puncher()
+{
+        close();
+}
+
+hole_puncher::hole_puncher(hole_puncher&& o) noexcept
+        : fd_(o.fd_), step_(o.step_), offset_(o.offset_), done_(o.done_),
+          filename_(std::move(o.filename_))
+{
+        o.fd_ = -1;
+}
+
+hole_puncher& hole_puncher::operator=(hole_puncher&& o) noexcept
+{
+        if (&o == this)
+                return *this;
+
+        close();
+
+        fd_ = o.fd_;
+        step_ = o.step_;
+        offset_ = o.offset_;
+        done_ = o.done_;
+        filename_ = std::move(o.filename_);
+
+        o.fd_ = -1;
+
+        return *this;
+}
+
+void hole_puncher::consumed(uint64_t offset)
+{
+        offset_ = std::max(offset_, offset);
+
+        if (fd_ != -1 && offset_ - done_ >= step_)
+                _punch(round_down(offset_, step_));
+}
+
 void _file_write(std::string&& filename, const void* data, size_t size)
 {
         //raw_file_writer f(std::move(filename));
@@ -201,7 +540,7 @@ void _file_write(std::string&& filename, const void* data, size_t size)
         f->open(filename.c_str(), size, std::ios::out | std::ios::trunc);
 
         auto r = f->range();
-        r->lock();
+        r->prefault();
 
         mem_copy(r->data(), data, r->size());
 }
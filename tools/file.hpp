@@ -6,6 +6,7 @@
 #include <random>
 #include <functional>
 #include <algorithm>
+#include <memory>
 
 #include "exception.hpp"
 #include "util.hpp"
@@ -13,6 +14,12 @@
 #include <fstream>
 #include "../config.hpp"
 
+/* std::unique_ptr<FILE, stdio_closer> */
+struct stdio_closer
+{
+        void operator()(FILE* f) const { fclose(f); }
+};
+
 void delete_file(const char* filename);
 
 void iterate_dir(const char* path, std::function<void(const char*)>&& callback);
@@ -21,6 +28,67 @@ bool check_dir_exist(const char* path);
 
 void create_directory(const char* name);
 
+uint64_t file_size(const char* filename);
+
+/* Copies up to len bytes between two file descriptors inside the kernel
+ * (copy_file_range), returns the number of bytes copied. A short count
+ * means the rest has to be copied by the caller through user space. */
+uint64_t file_copy_range(int fd_in, uint64_t off_in,
+                         int fd_out, uint64_t off_out, uint64_t len);
+
+/* Reads until the buffer is full or the stream ends, a pipe returns as
+ * much as the writer has put into it, returns the number of bytes read */
+size_t stream_read(int fd, void* data, size_t size);
+
+/* Gives the disk space of the consumed part of a file back while the rest
+ * is still being read (FALLOC_FL_PUNCH_HOLE), the file keeps its size. Does
+ * nothing if the file system can't punch holes */
+class hole_puncher
+{
+public:
+        hole_puncher() = default;
+        ~hole_puncher();
+
+        hole_puncher(hole_puncher&& o) noexcept;
+        hole_puncher& operator=(hole_puncher&& o) noexcept;
+
+        /* step - bytes punched out at a time */
+        void open(const std::string& filename, uint64_t step);
+
+        /* the bytes before offset aren't needed anymore */
+        void consumed(uint64_t offset);
+
+        /* punches out all that is consumed, the errors are ignored */
+        void close() noexcept;
+private:
+        void _punch(uint64_t end);
+private:
+        int fd_ = -1;
+        uint64_t step_ = 0;
+        uint64_t offset_ = 0, done_ = 0;
+        std::string filename_;
+};
+
+struct aligned_deleter
+{
+        void operator()(char* p) const noexcept;
+};
+
+using aligned_buffer = std::unique_ptr<char[], aligned_deleter>;
+
+/* memory for the I/O buffers which the kernel reads or writes directly */
+aligned_buffer make_aligned_buffer(size_t size, size_t alignment = PAGE_SIZE);
+
+/* O_DIRECT I/O, falls back to the buffered one if the file system doesn't
+ * support it. The offsets and the buffers must be aligned to PAGE_SIZE,
+ * the buffer must have room for the size rounded up to PAGE_SIZE */
+int file_open_direct(const char* filename, int flags);
+
+void file_read_direct(const char* filename, uint64_t offset,
+                      void* data, size_t size);
+
+void file_write_direct(const char* filename, const void* data, size_t size);
+
 void _file_write(std::string&& filename, const void* data, size_t size);
 
 template<typename String>
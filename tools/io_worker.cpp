@@ -0,0 +1,213 @@
+#include "io_worker.hpp"
+
+#include "../config.hpp"
+
+static std::size_t max_threads()
+{
+        std::size_t n = std::thread::hardware_concurrency();
+
+        return n ? n : CONFIG_DEFAULT_THREAD_NUMBER;
+}
+
+io_worker& io_worker::instance()
+{
+        static io_worker worker;
+
+        return worker;
+}
+
+io_worker::~io_worker()
+{
+        {
+                std::lock_guard<std::mutex> lk(lock_);
+                stop_ = true;
+        }
+
+        cv_.notify_all();
+
+        for (auto& thread : threads_)
+                thread.join();
+}
+
+std::future<void> io_worker::post(std::function<void()>&& job)
+{
+        std::packaged_task<void()> task(std::move(job));
+        auto result = task.get_future();
+
+        {
+                std::lock_guard<std::mutex> lk(lock_);
+
+                jobs_.push_back(std::move(task));
+
+                /* the idle threads take the jobs queued before this one
+                 * first */
+                if (idle_ < jobs_.size() && threads_.size() < max_threads())
+                        threads_.emplace_back(&io_worker::_run, this);
+        }
+
+        cv_.notify_one();
+
+        return result;
+}
+
+void io_worker::_run()
+{
+        for (;;)
+        {
+                std::packaged_task<void()> task;
+
+                {
+                        std::unique_lock<std::mutex> lk(lock_);
+
+                        ++idle_;
+
+                        cv_.wait(lk, [this]() {
+                                return stop_ || !jobs_.empty();
+                        });
+
+                        --idle_;
+
+                        if (jobs_.empty())
+                                return;
+
+                        task = std::move(jobs_.front());
+                        jobs_.pop_front();
+                }
+
+                task();
+        }
+}
+
+read_ahead::~read_ahead()
+{
+        close();
+}
+
+read_ahead& read_ahead::operator=(read_ahead&& o) noexcept
+{
+        /* the buffers can't go away under the read in flight */
+        close();
+
+        fill_ = std::move(o.fill_);
+        buffers_[0] = std::move(o.buffers_[0]);
+        buffers_[1] = std::move(o.buffers_[1]);
+        block_size_ = o.block_size_;
+        pending_ = std::move(o.pending_);
+        cur_ = o.cur_;
+        started_ = o.started_;
+
+        return *this;
+}
+
+void read_ahead::open(std::size_t block_size, fill_fn&& fill)
+{
+        fill_ = std::move(fill);
+        block_size_ = block_size;
+        started_ = false;
+        cur_ = 0;
+
+        for (auto& buffer : buffers_)
+                buffer.resize(block_size);
+
+        _fill(0);
+}
+
+const char* read_ahead::next_block(std::size_t& size)
+{
+        size = 0;
+
+        if (!pending_.valid())
+                return nullptr;
+
+        /* the other buffer is ready, the current one is refilled */
+        unsigned next = started_ ? cur_ ^ 1 : cur_;
+
+        size = pending_.get();
+
+        if (size == 0)
+                return nullptr;
+
+        if (started_)
+                _fill(cur_);
+        else
+                _fill(cur_ ^ 1);
+
+        started_ = true;
+        cur_ = next;
+
+        return buffers_[cur_].data();
+}
+
+void read_ahead::close() noexcept
+{
+        if (pending_.valid())
+                pending_.wait();
+
+        pending_ = std::future<std::size_t>();
+}
+
+void read_ahead::_fill(unsigned i)
+{
+        auto task = std::make_shared<std::packaged_task<std::size_t()>>(
+                std::bind(fill_, buffers_[i].data(), block_size_));
+
+        pending_ = task->get_future();
+
+        io_worker::instance().post([task]() { (*task)(); });
+}
+
+write_behind::~write_behind()
+{
+        if (pending_.valid())
+                pending_.wait();
+}
+
+write_behind& write_behind::operator=(write_behind&& o) noexcept
+{
+        if (pending_.valid())
+                pending_.wait();
+
+        drain_ = std::move(o.drain_);
+        buffers_[0] = std::move(o.buffers_[0]);
+        buffers_[1] = std::move(o.buffers_[1]);
+        block_size_ = o.block_size_;
+        pending_ = std::move(o.pending_);
+        cur_ = o.cur_;
+
+        return *this;
+}
+
+void write_behind::open(std::size_t block_size, drain_fn&& drain)
+{
+        drain_ = std::move(drain);
+        block_size_ = block_size;
+        cur_ = 0;
+
+        for (auto& buffer : buffers_)
+                buffer.resize(block_size);
+}
+
+char* write_behind::commit(std::size_t size)
+{
+        flush();
+
+        if (size)
+        {
+                auto drain = drain_;
+                const char* data = buffers_[cur_].data();
+
+                pending_ = io_worker::instance().post([drain, data, size]() {
+                        drain(data, size);
+                });
+        }
+
+        cur_ ^= 1;
+
+        return buffers_[cur_].data();
+}
+
+void write_behind::flush()
+{
+        if (pending_.valid())
+                pending_.get();
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Background threads shared by all the streams, they do the blocking reads
+ * and writes while the merge threads keep merging. A thread is added when
+ * a job comes and all of them are busy, up to one per hardware thread, so
+ * the streams of a wide merge or of parallel merges don't wait for each
+ * other in one queue */
+class io_worker
+{
+public:
+        static io_worker& instance();
+
+        ~io_worker();
+
+        io_worker(const io_worker&) = delete;
+        io_worker& operator=(const io_worker&) = delete;
+
+        /* an exception thrown by the job comes out of the future */
+        std::future<void> post(std::function<void()>&& job);
+private:
+        io_worker() = default;
+
+        void _run();
+private:
+        std::mutex lock_;
+        std::condition_variable cv_;
+        std::deque<std::packaged_task<void()>> jobs_;
+        std::vector<std::thread> threads_;
+        std::size_t idle_ = 0;
+        bool stop_ = false;
+};
+
+/* Double buffered reading: the worker fills one buffer while the other one
+ * is consumed */
+class read_ahead
+{
+public:
+        /* reads up to size bytes to the buffer, 0 at the end */
+        using fill_fn = std::function<std::size_t(char*, std::size_t)>;
+
+        read_ahead() = default;
+        ~read_ahead();
+
+        read_ahead(read_ahead&&) = default;
+        read_ahead& operator=(read_ahead&& o) noexcept;
+
+        /* block_size - size of each of the two buffers */
+        void open(std::size_t block_size, fill_fn&& fill);
+
+        /* the next block, the previous one goes back to the worker,
+         * nullptr at the end */
+        const char* next_block(std::size_t& size);
+
+        /* waits for the read in flight, its errors are ignored */
+        void close() noexcept;
+
+        std::size_t buff_size() const { return block_size_ * 2; }
+private:
+        void _fill(unsigned i);
+private:
+        fill_fn fill_;
+        std::vector<char> buffers_[2];
+        std::size_t block_size_ = 0;
+        std::future<std::size_t> pending_;
+        unsigned cur_ = 0;
+        bool started_ = false;
+};
+
+/* Double buffered writing: the worker writes one buffer while the other
+ * one is filled */
+class write_behind
+{
+public:
+        using drain_fn = std::function<void(const char*, std::size_t)>;
+
+        write_behind() = default;
+        ~write_behind();
+
+        write_behind(write_behind&&) = default;
+        write_behind& operator=(write_behind&& o) noexcept;
+
+        void open(std::size_t block_size, drain_fn&& drain);
+
+        /* a free buffer to fill, block_size() bytes */
+        char* block() { return buffers_[cur_].data(); }
+        std::size_t block_size() const { return block_size_; }
+
+        /* hands the first size bytes of the current block to the worker,
+         * returns the other one once it's written */
+        char* commit(std::size_t size);
+
+        /* waits for the write in flight */
+        void flush();
+
+        std::size_t buff_size() const { return block_size_ * 2; }
+private:
+        drain_fn drain_;
+        std::vector<char> buffers_[2];
+        std::size_t block_size_ = 0;
+        std::future<void> pending_;
+        unsigned cur_ = 0;
+};
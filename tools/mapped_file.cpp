@@ -5,9 +5,11 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <algorithm>
 
 #include "util.hpp"
 #include "exception.hpp"
+#include "../config.hpp"
 
 int madvace2posix(madvice adv)
 {
@@ -19,8 +21,43 @@ int madvace2posix(madvice adv)
                 return MADV_SEQUENTIAL;
         case madvice::random:
                 return MADV_RANDOM;
+        case madvice::willneed:
+                return MADV_WILLNEED;
         case madvice::dontneed:
                 return MADV_DONTNEED;
+        case madvice::remove:
+                return MADV_REMOVE;
+        /* -1 - the hint isn't known at the build time */
+        case madvice::populate_read:
+#if defined(MADV_POPULATE_READ)
+                return MADV_POPULATE_READ;
+#else
+                return -1;
+#endif
+        case madvice::populate_write:
+#if defined(MADV_POPULATE_WRITE)
+                return MADV_POPULATE_WRITE;
+#else
+                return -1;
+#endif
+        case madvice::hugepage:
+#if defined(MADV_HUGEPAGE)
+                return MADV_HUGEPAGE;
+#else
+                return -1;
+#endif
+        case madvice::cold:
+#if defined(MADV_COLD)
+                return MADV_COLD;
+#else
+                return -1;
+#endif
+        case madvice::pageout:
+#if defined(MADV_PAGEOUT)
+                return MADV_PAGEOUT;
+#else
+                return -1;
+#endif
         default:
                 THROW_EXCEPTION << "Unknown arg";
         }
@@ -29,6 +66,31 @@ int madvace2posix(madvice adv)
         return -1;
 }
 
+static bool is_hint(madvice adv)
+{
+        return adv == madvice::populate_read || adv == madvice::populate_write
+                || adv == madvice::hugepage || adv == madvice::cold
+                || adv == madvice::pageout;
+}
+
+void mapped_range::advise_open(unsigned policy, bool write)
+{
+        if (policy & CONFIG_MAP_HUGEPAGE)
+                advise(madvice::hugepage);
+
+        if (policy & CONFIG_MAP_POPULATE)
+                advise(write ? madvice::populate_write
+                             : madvice::populate_read);
+}
+
+void mapped_range::advise_close(unsigned policy)
+{
+        if (policy & CONFIG_MAP_PAGEOUT)
+                advise(madvice::pageout);
+        else if (policy & CONFIG_MAP_COLD)
+                advise(madvice::cold);
+}
+
 posix_mapped_range::posix_mapped_range(void* mem, std::size_t len) noexcept
         : mem_(mem), len_(len), locked_(false)
 {
@@ -67,6 +129,36 @@ void posix_mapped_range::unlock()
         locked_ = false;
 }
 
+bool posix_mapped_range::try_lock() noexcept
+{
+        locked_ = mlock(mem_, len_) == 0;
+
+        return locked_;
+}
+
+void posix_mapped_range::prefault()
+{
+#if defined(MADV_POPULATE_WRITE)
+        auto begin = round_down((uintptr_t)mem_, PAGE_SIZE);
+        auto end = round_up((uintptr_t)mem_ + len_, PAGE_SIZE);
+
+        if (madvise((void*)begin, end - begin, MADV_POPULATE_WRITE) == 0)
+                return;
+
+        if (errno != EINVAL)
+                THROW_EXCEPTION << "Prefault failed:" << put_errno;
+#endif
+        /* the old kernels: the pages are read in, the neighbours may share
+         * the edge pages, so nothing is written */
+        auto p = static_cast<volatile const char*>(mem_);
+
+        for (std::size_t off = 0; off < len_; off += PAGE_SIZE)
+                (void)p[off];
+
+        if (len_)
+                (void)p[len_ - 1];
+}
+
 void posix_mapped_range::sync()
 {
         if (msync(mem_, len_, MS_SYNC) == -1)
@@ -75,7 +167,47 @@ void posix_mapped_range::sync()
 
 void posix_mapped_range::advise(madvice adv)
 {
-        if (madvise(mem_, len_, madvace2posix(adv)) == -1)
+        advise(adv, 0, len_);
+}
+
+void posix_mapped_range::advise(madvice adv, std::size_t offset,
+                                std::size_t size)
+{
+        if (offset >= len_)
+                return;
+
+        size = std::min(size, len_ - offset);
+
+        auto begin = (uintptr_t)mem_ + offset;
+        auto end = begin + size;
+
+        /* ranges aren't page aligned, the hints that throw data away
+         * must not touch the neighbours' pages, so they are aligned
+         * inwards and the rest are aligned outwards */
+        if (adv == madvice::dontneed || adv == madvice::remove
+            || adv == madvice::cold || adv == madvice::pageout)
+        {
+                begin = round_up(begin, PAGE_SIZE);
+                end = round_down(end, PAGE_SIZE);
+        }
+        else
+        {
+                begin = round_down(begin, PAGE_SIZE);
+                end = round_up(end, PAGE_SIZE);
+        }
+
+        if (begin >= end)
+                return;
+
+        int posix_adv = madvace2posix(adv);
+
+        if (posix_adv == -1)
+                return;
+
+        /* the hints are refused for some kinds of memory (no THP for the
+         * file pages, no populate for the old kernels) */
+        if (madvise((void*)begin, end - begin, posix_adv) == -1
+            && !(is_hint(adv) && (errno == EINVAL || errno == EPERM)))
                 THROW_EXCEPTION << "madvise error:" << put_errno;
 }
 
@@ -91,9 +223,68 @@ std::unique_ptr<mapped_file> posix_mapped_range::map_to_new_file(
         return std::move(nf);
 }
 
+std::unique_ptr<mapped_range> posix_mapped_range::range(std::size_t offset,
+                                                       std::size_t size)
+{
+        if (offset > len_ || size > len_ - offset)
+                THROW_EXCEPTION << "Range [" << offset << ", " << size
+                                << "] is out of [0, " << len_ << "]";
+
+        auto p = new posix_mapped_range((char*)mem_ + offset, size);
+
+        return std::unique_ptr<mapped_range>(p);
+}
+
 void* posix_mapped_range::data() const { return mem_; }
 std::size_t posix_mapped_range::size() const { return len_; }
 
+static void* map_anonymous(std::size_t size)
+{
+        void* mem = mmap(nullptr, round_up(std::max<std::size_t>(size, 1),
+                                           PAGE_SIZE),
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (mem == MAP_FAILED)
+                THROW_EXCEPTION << "Cannot map " << size
+                                << " bytes of memory: " << put_errno;
+
+        return mem;
+}
+
+posix_anonymous_range::posix_anonymous_range(std::size_t size)
+        : posix_mapped_range(map_anonymous(size), size)
+{
+}
+
+posix_anonymous_range::~posix_anonymous_range()
+{
+        if (locked_)
+                munlock(mem_, len_);
+
+        locked_ = false;
+
+        if (mem_)
+                munmap(mem_, round_up(std::max<std::size_t>(len_, 1), PAGE_SIZE));
+}
+
+posix_private_range::posix_private_range(void* map, std::size_t shift,
+                                         std::size_t size)
+        : posix_mapped_range((char*)map + shift, size),
+          map_(map), map_len_(shift + size)
+{
+}
+
+posix_private_range::~posix_private_range()
+{
+        if (locked_)
+                munlock(mem_, len_);
+
+        locked_ = false;
+
+        munmap(map_, std::max<std::size_t>(map_len_, 1));
+}
+
 posix_mapped_file::posix_mapped_file()
         : fd_(-1), map_(MAP_FAILED)
 {
@@ -136,6 +327,68 @@ void posix_mapped_file::open(const char* filename, std::ios::openmode mode)
 
 void posix_mapped_file::open(const char* filename, std::size_t size,
                              std::ios::openmode mode)
+{
+        _open(filename, size, mode, true);
+}
+
+void posix_mapped_file::open_sparse(const char* filename, std::size_t size,
+                                    std::ios::openmode mode)
+{
+        _open(filename, size, mode, false);
+}
+
+void posix_mapped_file::allocate(std::size_t offset, std::size_t size)
+{
+        /* the descriptor isn't kept after the file is mapped */
+        int fd = ::open(filename_.c_str(), O_WRONLY | __O_NOATIME);
+        if (fd == -1)
+                THROW_FILE_EXCEPTION(filename_) << "Cannot open file";
+
+        int err = posix_fallocate(fd, offset, size);
+
+        ::close(fd);
+
+        if (err)
+        {
+                errno = err;
+                THROW_FILE_EXCEPTION(filename_) << "Cannot allocate ["
+                                                << offset << ", " << size
+                                                << "]";
+        }
+}
+
+void posix_mapped_file::writeback(std::size_t offset, std::size_t size,
+                                  bool wait)
+{
+#if defined(__linux__)
+        int fd = ::open(filename_.c_str(), O_WRONLY | __O_NOATIME);
+        if (fd == -1)
+                THROW_FILE_EXCEPTION(filename_) << "Cannot open file";
+
+        unsigned flags = wait ? SYNC_FILE_RANGE_WAIT_BEFORE
+                                | SYNC_FILE_RANGE_WRITE
+                                | SYNC_FILE_RANGE_WAIT_AFTER
+                              : SYNC_FILE_RANGE_WRITE;
+
+        int res = sync_file_range(fd, offset, size, flags);
+
+        ::close(fd);
+
+        if (res == -1)
+                THROW_FILE_EXCEPTION(filename_) << "Cannot write back ["
+                                                << offset << ", " << size
+                                                << "]";
+#else
+        auto begin = round_down((uintptr_t)map_ + offset, PAGE_SIZE);
+        auto end = (uintptr_t)map_ + offset + size;
+
+        if (msync((void*)begin, end - begin, wait ? MS_SYNC : MS_ASYNC) == -1)
+                THROW_FILE_EXCEPTION(filename_) << "msync failed";
+#endif
+}
+
+void posix_mapped_file::_open(const char* filename, std::size_t size,
+                              std::ios::openmode mode, bool allocate)
 {
         size_ = size;
         filename_ = filename;
@@ -151,9 +404,17 @@ void posix_mapped_file::open(const char* filename, std::size_t size,
         if (fd_ == -1)
                 THROW_FILE_EXCEPTION(filename_) << "Cannot open file";
 
-        if (posix_fallocate(fd_, 0, size) == -1)
+        if (allocate && posix_fallocate(fd_, 0, size) == -1)
                 THROW_FILE_EXCEPTION(filename_) << "posix_fallocate failed:";
 
+        if (!allocate && ftruncate(fd_, size) == -1)
+        {
+                ::close(fd_);
+                fd_ = -1;
+
+                THROW_FILE_EXCEPTION(filename_) << "Cannot truncate the file";
+        }
+
         int map_prot = mode & std::ios::out
                                ? PROT_READ | PROT_WRITE
                                : PROT_READ;
@@ -201,8 +462,41 @@ std::unique_ptr<mapped_range> posix_mapped_file::range()
         return this->range(0, size_);
 }
 
+std::unique_ptr<mapped_range> posix_mapped_file::private_range(
+        std::size_t offset, std::size_t size)
+{
+        if (!this->is_open())
+                THROW_EXCEPTION << "File " << quote(filename_) <<
+                        " is not open";
+
+        /* the descriptor isn't kept after the file is mapped, a read-only
+         * one is enough for the private mapping */
+        int fd = ::open(filename_.c_str(), O_RDONLY | __O_NOATIME);
+        if (fd == -1)
+                THROW_FILE_EXCEPTION(filename_) << "Cannot open file";
+
+        std::size_t map_offset = round_down(offset, PAGE_SIZE);
+        std::size_t shift = offset - map_offset;
+
+        void* map = ::mmap(nullptr, std::max<std::size_t>(shift + size, 1),
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                           fd, map_offset);
+
+        ::close(fd);
+
+        if (map == MAP_FAILED)
+                THROW_FILE_EXCEPTION(filename_) << "Cannot map [" << offset
+                                                << ", " << size << "]";
+
+        auto p = new posix_private_range(map, shift, size);
+
+        return std::unique_ptr<mapped_range>(p);
+}
+
 std::size_t posix_mapped_file::size() const { return size_; }
 
+const std::string& posix_mapped_file::filename() const { return filename_; }
+
 int posix_mapped_file::parse_open_mode(std::ios::openmode mode)
 {
         int o_flags = 0;
@@ -248,6 +542,15 @@ bool posix_mapped_file::is_open() const
 }
 
 
+std::unique_ptr<mapped_range> mapped_range::create_anonymous(std::size_t size)
+{
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+        return std::unique_ptr<mapped_range>(new posix_anonymous_range(size));
+#else
+        THROW_EXCEPTION << "Not implemented";
+#endif
+}
+
 std::unique_ptr<mapped_file> mapped_file::create()
 {
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
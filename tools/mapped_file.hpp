@@ -3,6 +3,7 @@
 #include <cstddef> // std::size_t
 #include <memory> // std::unique_ptr
 #include <ios> // std::ios::openmode
+#include <string>
 
 struct mapped_file;
 
@@ -11,7 +12,16 @@ enum class madvice
         normal,
         sequential,
         random,
-        dontneed
+        willneed,
+        dontneed,
+        /* punches the pages out of the file, a shared writable mapping */
+        remove,
+        /* the hints below are skipped if the kernel doesn't know them */
+        populate_read,
+        populate_write,
+        hugepage,
+        cold,
+        pageout
 };
 
 struct mapped_range
@@ -20,14 +30,37 @@ struct mapped_range
 
         virtual void lock() = 0;
         virtual void unlock() = 0;
+
+        /* false if the range may not be locked (RLIMIT_MEMLOCK) */
+        virtual bool try_lock() noexcept = 0;
+
+        /* faults the range in for writing without locking it */
+        virtual void prefault() = 0;
+
         virtual void sync() = 0;
         virtual void advise(madvice adv) = 0;
+        virtual void advise(madvice adv, std::size_t offset,
+                            std::size_t size) = 0;
+
+        /* the CONFIG_MAP_* policy of a stage for a range it starts to use,
+         * write - it's faulted in for writing */
+        void advise_open(unsigned policy, bool write);
+
+        /* and for a range it's done with */
+        void advise_close(unsigned policy);
 
         virtual std::unique_ptr<mapped_file> 
         map_to_new_file(const char* filename) = 0;
 
+        /* a view of the part of the range, it doesn't own the memory */
+        virtual std::unique_ptr<mapped_range> range(std::size_t offset,
+                                                    std::size_t size) = 0;
+
         virtual void* data() const = 0;
         virtual std::size_t size() const = 0;
+
+        /* page aligned memory which isn't backed by a file */
+        static std::unique_ptr<mapped_range> create_anonymous(std::size_t size);
 };
 
 struct mapped_file
@@ -38,6 +71,18 @@ struct mapped_file
         virtual void open(const char* filename, std::size_t size,
                 std::ios::openmode mode) = 0;
 
+        /* the file is of the size, but its disk space is allocated by
+         * allocate() as it's written */
+        virtual void open_sparse(const char* filename, std::size_t size,
+                std::ios::openmode mode) = 0;
+
+        virtual void allocate(std::size_t offset, std::size_t size) = 0;
+
+        /* starts writing the dirty pages of the part back to the disk,
+         * wait - and waits until they're written */
+        virtual void writeback(std::size_t offset, std::size_t size,
+                               bool wait) = 0;
+
         virtual bool is_open() const = 0;
 
         virtual std::unique_ptr<mapped_range> range(std::size_t offset,
@@ -45,8 +90,16 @@ struct mapped_file
 
         virtual std::unique_ptr<mapped_range> range() = 0;
 
+        /* a copy-on-write mapping of the part of the file, it's writable
+         * even if the file is open read-only and the changes never reach
+         * the file */
+        virtual std::unique_ptr<mapped_range> private_range(std::size_t offset,
+                std::size_t size) = 0;
+
         virtual std::size_t size() const = 0;
 
+        virtual const std::string& filename() const = 0;
+
         static std::unique_ptr<mapped_file> create();
 };
 
@@ -65,20 +118,51 @@ public:
 
         void unlock() override;
 
+        bool try_lock() noexcept override;
+
+        void prefault() override;
+
         void sync() override;
 
         void advise(madvice adv) override;
 
+        void advise(madvice adv, std::size_t offset,
+                    std::size_t size) override;
+
         std::unique_ptr<mapped_file> map_to_new_file(const char* filename) override;
 
+        std::unique_ptr<mapped_range> range(std::size_t offset,
+                                            std::size_t size) override;
+
         void* data() const override;
         std::size_t size() const override;
-private:
+protected:
         void* mem_;
         std::size_t len_;
         bool locked_;
 };
 
+class posix_anonymous_range : public posix_mapped_range
+{
+public:
+        explicit posix_anonymous_range(std::size_t size);
+
+        ~posix_anonymous_range();
+};
+
+class posix_private_range : public posix_mapped_range
+{
+public:
+        /* shift - offset of the range in the mapping which starts at
+         * the page boundary */
+        posix_private_range(void* map, std::size_t shift, std::size_t size);
+
+        ~posix_private_range();
+private:
+        void* map_;
+        std::size_t map_len_;
+};
+
 class posix_mapped_file : public mapped_file
 {
 public:
@@ -89,6 +173,14 @@ public:
         void open(const char* filename, std::size_t size,
                 std::ios::openmode mode) override;
 
+        void open_sparse(const char* filename, std::size_t size,
+                std::ios::openmode mode) override;
+
+        void allocate(std::size_t offset, std::size_t size) override;
+
+        void writeback(std::size_t offset, std::size_t size,
+                       bool wait) override;
+
         ~posix_mapped_file();
 
         void copy(posix_mapped_file& dest);
@@ -99,10 +191,18 @@ public:
 
         std::unique_ptr<mapped_range> range() override;
 
+        std::unique_ptr<mapped_range> private_range(std::size_t offset,
+                                                    std::size_t size) override;
+
         std::size_t size() const override;
+
+        const std::string& filename() const override;
 private:
         int parse_open_mode(std::ios::openmode mode);
 
+        void _open(const char* filename, std::size_t size,
+                   std::ios::openmode mode, bool allocate);
+
 public:
         posix_mapped_file(posix_mapped_file&& o) noexcept;
 
@@ -1,5 +1,12 @@
 #pragma once
 #include <chrono>
+#include <ostream>
+#if defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <unistd.h>
+#endif
 #include "../log.hpp"
 
 class perf_timer
@@ -111,3 +118,110 @@ private:
         const char* const msg_literal_;
 };
 
+
+/* page faults of the calling thread, zero where it's not supported */
+struct page_faults
+{
+        uint64_t minor = 0;
+        uint64_t major = 0;
+
+        static page_faults now()
+        {
+                page_faults pf;
+#if defined(__linux__)
+                struct rusage ru;
+
+                if (getrusage(RUSAGE_THREAD, &ru) == 0)
+                {
+                        pf.minor = ru.ru_minflt;
+                        pf.major = ru.ru_majflt;
+                }
+#endif
+                return pf;
+        }
+
+        page_faults operator-(const page_faults& o) const
+        {
+                page_faults pf;
+                pf.minor = minor - o.minor;
+                pf.major = major - o.major;
+
+                return pf;
+        }
+
+        friend std::ostream& operator<<(std::ostream& os,
+                                        const page_faults& pf)
+        {
+                return os << pf.minor << " minor / " << pf.major
+                          << " major faults";
+        }
+};
+
+/* Last level cache misses of the calling thread from the PMU
+ * (perf_event_open), counted from the construction on. Where the PMU isn't
+ * exposed, as in most VMs, or perf_event_paranoid forbids it the count is
+ * printed as n/a */
+class cache_misses
+{
+public:
+        cache_misses()
+        {
+#if defined(__linux__)
+                perf_event_attr attr{};
+                attr.size = sizeof(attr);
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_LL
+                            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+
+                fd_ = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+                /* not every PMU has the LL event, the generic one is the
+                 * LLC on most of them */
+                if (fd_ == -1)
+                {
+                        attr.type = PERF_TYPE_HARDWARE;
+                        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+
+                        fd_ = (int)syscall(SYS_perf_event_open, &attr, 0, -1,
+                                           -1, 0);
+                }
+#endif
+        }
+
+        ~cache_misses()
+        {
+#if defined(__linux__)
+                if (fd_ != -1)
+                        close(fd_);
+#endif
+        }
+
+        cache_misses(const cache_misses&) = delete;
+        cache_misses& operator=(const cache_misses&) = delete;
+
+        bool supported() const { return fd_ != -1; }
+
+        uint64_t count() const
+        {
+                uint64_t n = 0;
+#if defined(__linux__)
+                if (fd_ != -1 && read(fd_, &n, sizeof(n)) != sizeof(n))
+                        n = 0;
+#endif
+                return n;
+        }
+
+        friend std::ostream& operator<<(std::ostream& os,
+                                        const cache_misses& cm)
+        {
+                if (!cm.supported())
+                        return os << "n/a LLC misses";
+
+                return os << cm.count() << " LLC misses";
+        }
+private:
+        int fd_ = -1;
+};
@@ -11,6 +11,8 @@ public:
 
         T* begin() const { return ptr_; }
         T* end() const { return begin() + size_; }
+
+        std::size_t size() const { return size_; }
 private:
         T* const ptr_;
         std::size_t size_;
@@ -0,0 +1,123 @@
+#include "stream_writer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/uio.h>
+#endif
+
+#include "exception.hpp"
+#include "util.hpp"
+
+stream_writer::stream_writer(int fd, std::size_t buff_size)
+        : fd_(fd)
+{
+        block_size_ = std::max<std::size_t>(
+                round_down(buff_size / 2, PAGE_SIZE), PAGE_SIZE);
+
+#if defined(__linux__)
+        struct stat sb{};
+
+        if (::fstat(fd_, &sb) == 0 && S_ISFIFO(sb.st_mode))
+        {
+                /* the pipe size is limited (/proc/sys/fs/pipe-max-size),
+                 * it's asked for less until it grows, a block is what
+                 * it holds then */
+                for (std::size_t size = block_size_; size > PAGE_SIZE;
+                     size /= 2)
+                        if (::fcntl(fd_, F_SETPIPE_SZ, (int)size) != -1)
+                                break;
+
+                int pipe_size = ::fcntl(fd_, F_GETPIPE_SZ);
+
+                if (pipe_size > 0)
+                {
+                        block_size_ = pipe_size;
+                        splice_ = true;
+                }
+        }
+#endif
+
+        buffer_ = mapped_range::create_anonymous(block_size_ * 2);
+
+        blocks_[0] = static_cast<char*>(buffer_->data());
+        blocks_[1] = blocks_[0] + block_size_;
+}
+
+char* stream_writer::commit(std::size_t size)
+{
+        const char* data = blocks_[cur_];
+
+        if (!splice_ || !_splice(data, size))
+                _write(data, size);
+
+        cur_ ^= 1;
+
+        return blocks_[cur_];
+}
+
+void stream_writer::_write(const char* data, std::size_t size)
+{
+        while (size)
+        {
+                ssize_t r = ::write(fd_, data, size);
+
+                if (r == -1)
+                {
+                        if (errno == EINTR)
+                                continue;
+
+                        THROW_EXCEPTION << "Cannot write the stream: "
+                                        << put_errno;
+                }
+
+                data += r;
+                size -= r;
+        }
+}
+
+/* false if the descriptor can't splice, nothing is written then */
+bool stream_writer::_splice(const char* data, std::size_t size)
+{
+#if defined(__linux__)
+        bool first = true;
+
+        while (size)
+        {
+                iovec iov{ const_cast<char*>(data), size };
+
+                ssize_t r = ::vmsplice(fd_, &iov, 1, 0);
+
+                if (r == -1)
+                {
+                        if (errno == EINTR)
+                                continue;
+
+                        if (first && (errno == EINVAL || errno == ENOSYS))
+                        {
+                                splice_ = false;
+                                return false;
+                        }
+
+                        THROW_EXCEPTION << "Cannot splice to the stream: "
+                                        << put_errno;
+                }
+
+                first = false;
+                data += r;
+                size -= r;
+        }
+
+        return true;
+#else
+        (void)data;
+        (void)size;
+
+        return false;
+#endif
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+
+#include "mapped_file.hpp"
+
+/* Writes a stream (stdout) sequentially in large blocks. If it's a pipe the
+ * pages are handed to it with vmsplice instead of being copied: the pipe is
+ * resized to a block and there are two blocks, once one of them is spliced
+ * whole the pipe can't hold anything of the other one, so that one is free
+ * to be refilled. Anything else is written with write() */
+class stream_writer
+{
+public:
+        stream_writer(int fd, std::size_t buff_size);
+
+        stream_writer(const stream_writer&) = delete;
+        stream_writer& operator=(const stream_writer&) = delete;
+
+        /* a free buffer to fill, block_size() bytes */
+        char* block() const { return blocks_[cur_]; }
+        std::size_t block_size() const { return block_size_; }
+
+        /* writes the first size bytes of the current block and returns
+         * the other one */
+        char* commit(std::size_t size);
+
+        std::size_t buff_size() const { return block_size_ * 2; }
+
+        bool spliced() const { return splice_; }
+private:
+        void _write(const char* data, std::size_t size);
+        bool _splice(const char* data, std::size_t size);
+private:
+        int fd_;
+        bool splice_ = false;
+        std::size_t block_size_ = 0;
+
+        /* the memory may stay referenced by the pipe after we are gone,
+         * it's mapped rather than allocated so it's never reused */
+        mapped_range_uptr buffer_;
+        char* blocks_[2];
+        unsigned cur_ = 0;
+};
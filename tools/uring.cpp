@@ -0,0 +1,611 @@
+#include "uring.hpp"
+
+#include "exception.hpp"
+
+#if defined(__linux__)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+#if !defined(__NR_io_uring_setup)
+#define __NR_io_uring_setup 425
+#define __NR_io_uring_enter 426
+#define __NR_io_uring_register 427
+#endif
+
+static int io_uring_setup(unsigned entries, io_uring_params* p)
+{
+        return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+        return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                            flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void* arg,
+                             unsigned nr_args)
+{
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uring::uring(unsigned entries)
+{
+        io_uring_params p{};
+
+        fd_ = io_uring_setup(entries, &p);
+        if (fd_ == -1)
+                THROW_EXCEPTION << "io_uring_setup failed: " << put_errno;
+
+        entries_ = p.sq_entries;
+
+        sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+
+        bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+                sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+
+        sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+
+        if (sq_ptr_ != MAP_FAILED)
+        {
+                cq_ptr_ = single_mmap
+                        ? sq_ptr_
+                        : mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, fd_,
+                               IORING_OFF_CQ_RING);
+
+                sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        }
+
+        if (sq_ptr_ == MAP_FAILED || cq_ptr_ == MAP_FAILED
+            || sqes_ == MAP_FAILED)
+        {
+                int err = errno;
+                _release();
+                errno = err;
+
+                THROW_EXCEPTION << "Cannot map io_uring: " << put_errno;
+        }
+
+        auto sq = static_cast<char*>(sq_ptr_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+        auto cq = static_cast<char*>(cq_ptr_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes_ = cq + p.cq_off.cqes;
+}
+
+uring::~uring()
+{
+        _release();
+}
+
+void uring::_release() noexcept
+{
+        if (sqes_ && sqes_ != MAP_FAILED)
+                munmap(sqes_, sqes_size_);
+
+        if (cq_ptr_ && cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_)
+                munmap(cq_ptr_, cq_size_);
+
+        if (sq_ptr_ && sq_ptr_ != MAP_FAILED)
+                munmap(sq_ptr_, sq_size_);
+
+        if (fd_ != -1)
+                ::close(fd_);
+
+        sqes_ = cq_ptr_ = sq_ptr_ = nullptr;
+        fd_ = -1;
+}
+
+bool uring::register_buffers(const iovec* iov, unsigned n) noexcept
+{
+        fixed_ = io_uring_register(fd_, IORING_REGISTER_BUFFERS, iov, n) == 0;
+
+        return fixed_;
+}
+
+void uring::read(int fd, void* buf, uint32_t len, uint64_t offset,
+                 uint64_t user_data, int buf_index)
+{
+        bool fixed = fixed_ && buf_index >= 0;
+
+        _queue(fixed ? IORING_OP_READ_FIXED : IORING_OP_READ,
+               fd, buf, len, offset, user_data, buf_index);
+}
+
+void uring::write(int fd, const void* buf, uint32_t len, uint64_t offset,
+                  uint64_t user_data, int buf_index)
+{
+        bool fixed = fixed_ && buf_index >= 0;
+
+        _queue(fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE,
+               fd, buf, len, offset, user_data, buf_index);
+}
+
+void uring::submit()
+{
+        while (to_submit_)
+                to_submit_ -= _enter(to_submit_, 0, 0);
+}
+
+uring::completion uring::wait()
+{
+        for (;;)
+        {
+                unsigned head = *cq_head_;
+                unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+                if (head != tail)
+                {
+                        auto cqe = static_cast<io_uring_cqe*>(cqes_)
+                                 + (head & *cq_mask_);
+
+                        completion c{ cqe->user_data, cqe->res };
+
+                        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+                        --in_flight_;
+
+                        return c;
+                }
+
+                if (in_flight_ == 0)
+                        THROW_EXCEPTION << "No io_uring requests to wait for";
+
+                to_submit_ -= _enter(to_submit_, 1, IORING_ENTER_GETEVENTS);
+        }
+}
+
+bool uring::supported() noexcept
+{
+        static const bool supported = []()
+        {
+                io_uring_params p{};
+
+                int fd = io_uring_setup(1, &p);
+                if (fd == -1)
+                        return false;
+
+                ::close(fd);
+
+                /* IORING_OP_READ/WRITE came along with this feature (5.6) */
+                return (p.features & IORING_FEAT_RW_CUR_POS) != 0;
+        }();
+
+        return supported;
+}
+
+void uring::_queue(uint8_t opcode, int fd, const void* buf, uint32_t len,
+                   uint64_t offset, uint64_t user_data, int buf_index)
+{
+        unsigned tail = *sq_tail_;
+
+        if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == entries_)
+        {
+                submit();
+
+                if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)
+                    == entries_)
+                        THROW_EXCEPTION << "io_uring submission queue is full";
+        }
+
+        unsigned idx = tail & *sq_mask_;
+        auto sqe = static_cast<io_uring_sqe*>(sqes_) + idx;
+
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->off = offset;
+        sqe->addr = reinterpret_cast<uint64_t>(buf);
+        sqe->len = len;
+        sqe->user_data = user_data;
+
+        if (buf_index >= 0)
+                sqe->buf_index = (uint16_t)buf_index;
+
+        sq_array_[idx] = idx;
+
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+        ++to_submit_;
+        ++in_flight_;
+}
+
+int uring::_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+        int ret = io_uring_enter(fd_, to_submit, min_complete, flags);
+
+        if (ret == -1)
+        {
+                if (errno == EINTR)
+                        return 0;
+
+                THROW_EXCEPTION << "io_uring_enter failed: " << put_errno;
+        }
+
+        return ret;
+}
+
+static uint64_t fd_size(int fd, const std::string& filename)
+{
+        struct stat sb{};
+
+        if (fstat(fd, &sb) == -1)
+                THROW_FILE_EXCEPTION(filename) << "Cannot get file stat";
+
+        return (uint64_t)sb.st_size;
+}
+
+static std::size_t io_block_size(std::size_t buff_size, unsigned buff_n)
+{
+        return std::max(PAGE_SIZE, round_down(buff_size / buff_n, PAGE_SIZE));
+}
+
+/* a ring per stream, the fixed buffers save mapping the user pages on
+ * every request */
+static std::unique_ptr<uring> make_ring(char* buffer, std::size_t block_size,
+                                        unsigned buff_n)
+{
+        if (!uring::supported())
+                return nullptr;
+
+        std::unique_ptr<uring> ring(new uring(buff_n));
+
+        std::vector<iovec> iov(buff_n);
+        for (unsigned i = 0; i < buff_n; ++i)
+                iov[i] = iovec{ buffer + i * block_size, block_size };
+
+        ring->register_buffers(iov.data(), buff_n);
+
+        return ring;
+}
+
+/* the transfer size, O_DIRECT needs it aligned, the end of the file
+ * makes the read short */
+static uint32_t io_len(uint32_t len, bool direct)
+{
+        return direct ? round_up(len, (uint32_t)PAGE_SIZE) : len;
+}
+
+uring_reader::uring_reader(const std::string& filename,
+                           std::size_t buff_size, unsigned buff_n,
+                           bool direct, uint64_t size)
+        : filename_(filename), direct_(direct)
+{
+        fd_ = direct
+                ? file_open_direct(filename.c_str(), O_RDONLY)
+                : ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd_ == -1)
+                THROW_FILE_EXCEPTION(filename) << "Cannot open the file";
+
+        size_ = std::min(fd_size(fd_, filename_), size);
+
+        buff_n = std::max(buff_n, 1u);
+        block_size_ = io_block_size(buff_size, buff_n);
+        buffer_ = make_aligned_buffer(block_size_ * buff_n);
+
+        slots_.resize(buff_n);
+        for (unsigned i = 0; i < buff_n; ++i)
+                slots_[i] = slot{ &buffer_[i * block_size_], 0, 0,
+                                  false, false };
+
+        ring_ = make_ring(buffer_.get(), block_size_, buff_n);
+
+        for (unsigned i = 0; i < buff_n; ++i)
+                _issue(i);
+
+        if (ring_)
+                ring_->submit();
+}
+
+uring_reader::~uring_reader()
+{
+        try
+        {
+                while (ring_ && ring_->in_flight())
+                        ring_->wait();
+        }
+        catch (...)
+        {
+        }
+
+        ring_.reset();
+
+        if (fd_ != -1)
+                ::close(fd_);
+}
+
+const char* uring_reader::next_block(std::size_t& size)
+{
+        if (last_ != (unsigned)-1)
+        {
+                _issue(last_);
+
+                if (ring_)
+                        ring_->submit();
+        }
+
+        slot& s = slots_[cur_];
+
+        if (!s.issued)
+        {
+                size = 0;
+                return nullptr;
+        }
+
+        while (s.pending)
+                _complete(ring_->wait());
+
+        last_ = cur_;
+        cur_ = (cur_ + 1) % slots_.size();
+
+        size = s.len;
+        return s.data;
+}
+
+void uring_reader::_issue(unsigned i)
+{
+        slot& s = slots_[i];
+
+        if (next_offset_ >= size_)
+        {
+                s.issued = false;
+                return;
+        }
+
+        s.offset = next_offset_;
+        s.len = (uint32_t)std::min<uint64_t>(block_size_, size_ - s.offset);
+        s.issued = true;
+        s.pending = true;
+
+        next_offset_ += s.len;
+
+        if (ring_)
+                ring_->read(fd_, s.data, io_len(s.len, direct_), s.offset,
+                            i, (int)i);
+        else
+                _complete(uring::completion{ i, 0 });
+}
+
+void uring_reader::_complete(const uring::completion& c)
+{
+        slot& s = slots_[c.user_data];
+
+        if (c.res < 0)
+        {
+                errno = -c.res;
+                THROW_FILE_EXCEPTION(filename_) << "Cannot read the file";
+        }
+
+        /* a short read is finished synchronously */
+        for (uint32_t done = (uint32_t)c.res; done < s.len; )
+        {
+                if (direct_)
+                        done = round_down(done, (uint32_t)PAGE_SIZE);
+
+                ssize_t r = pread(fd_, s.data + done,
+                                  io_len(s.len - done, direct_),
+                                  s.offset + done);
+
+                if (r == -1 && errno == EINTR)
+                        continue;
+
+                if (r <= 0)
+                        THROW_FILE_EXCEPTION(filename_)
+                                << "Cannot read the file";
+
+                done += (uint32_t)r;
+        }
+
+        s.pending = false;
+}
+
+uring_writer::uring_writer(const std::string& filename,
+                           std::size_t buff_size, unsigned buff_n,
+                           bool direct)
+        : filename_(filename), direct_(direct)
+{
+        fd_ = direct
+                ? file_open_direct(filename.c_str(),
+                                   O_WRONLY | O_CREAT | O_TRUNC)
+                : ::open(filename.c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+        if (fd_ == -1)
+                THROW_FILE_EXCEPTION(filename) << "Cannot open the file";
+
+        buff_n = std::max(buff_n, 1u);
+        block_size_ = io_block_size(buff_size, buff_n);
+        buffer_ = make_aligned_buffer(block_size_ * buff_n);
+
+        slots_.resize(buff_n);
+        for (unsigned i = 0; i < buff_n; ++i)
+                slots_[i] = slot{ &buffer_[i * block_size_], 0, 0, false };
+
+        ring_ = make_ring(buffer_.get(), block_size_, buff_n);
+}
+
+uring_writer::~uring_writer()
+{
+        try
+        {
+                while (ring_ && ring_->in_flight())
+                        ring_->wait();
+        }
+        catch (...)
+        {
+        }
+
+        ring_.reset();
+
+        if (fd_ != -1)
+                ::close(fd_);
+}
+
+char* uring_writer::commit(std::size_t size)
+{
+        slot& s = slots_[cur_];
+
+        if (size)
+        {
+                if (direct_ && size_ != offset_)
+                        THROW_FILE_EXCEPTION(filename_)
+                                << "Only the last block may be partial";
+
+                s.offset = offset_;
+                s.len = io_len((uint32_t)size, direct_);
+                s.pending = true;
+
+                std::memset(s.data + size, 0, s.len - size);
+
+                offset_ += s.len;
+                size_ += size;
+
+                if (ring_)
+                {
+                        ring_->write(fd_, s.data, s.len, s.offset, cur_,
+                                     (int)cur_);
+                        ring_->submit();
+                }
+                else
+                {
+                        _complete(uring::completion{ cur_, 0 });
+                }
+        }
+
+        cur_ = (cur_ + 1) % slots_.size();
+
+        while (slots_[cur_].pending)
+                _complete(ring_->wait());
+
+        return slots_[cur_].data;
+}
+
+void uring_writer::close()
+{
+        if (fd_ == -1)
+                return;
+
+        _drain();
+
+        int fd = fd_;
+        fd_ = -1;
+
+        if (offset_ != size_ && ftruncate(fd, size_) == -1)
+        {
+                int err = errno;
+                ::close(fd);
+                errno = err;
+
+                THROW_FILE_EXCEPTION(filename_) << "Cannot truncate the file";
+        }
+
+        if (::close(fd) == -1)
+                THROW_FILE_EXCEPTION(filename_) << "Cannot close the file";
+}
+
+void uring_writer::_complete(const uring::completion& c)
+{
+        slot& s = slots_[c.user_data];
+
+        if (c.res < 0)
+        {
+                errno = -c.res;
+                THROW_FILE_EXCEPTION(filename_) << "Cannot write the file";
+        }
+
+        /* a short write is finished synchronously */
+        for (uint32_t done = (uint32_t)c.res; done < s.len; )
+        {
+                if (direct_)
+                        done = round_down(done, (uint32_t)PAGE_SIZE);
+
+                ssize_t r = pwrite(fd_, s.data + done, s.len - done,
+                                   s.offset + done);
+
+                if (r == -1 && errno == EINTR)
+                        continue;
+
+                if (r <= 0)
+                        THROW_FILE_EXCEPTION(filename_)
+                                << "Cannot write the file";
+
+                done += (uint32_t)r;
+        }
+
+        s.pending = false;
+}
+
+void uring_writer::_drain()
+{
+        while (ring_ && ring_->in_flight())
+                _complete(ring_->wait());
+}
+
+#else
+
+uring::uring(unsigned)
+{
+        THROW_EXCEPTION << "io_uring is not supported";
+}
+
+uring::~uring() = default;
+
+bool uring::register_buffers(const iovec*, unsigned) noexcept { return false; }
+
+void uring::read(int, void*, uint32_t, uint64_t, uint64_t, int) {}
+
+void uring::write(int, const void*, uint32_t, uint64_t, uint64_t, int) {}
+
+void uring::submit() {}
+
+uring::completion uring::wait() { return completion{ 0, 0 }; }
+
+bool uring::supported() noexcept { return false; }
+
+uring_reader::uring_reader(const std::string&, std::size_t, unsigned, bool,
+                           uint64_t)
+{
+        THROW_EXCEPTION << "io_uring is not supported";
+}
+
+uring_reader::~uring_reader() = default;
+
+const char* uring_reader::next_block(std::size_t& size)
+{
+        size = 0;
+        return nullptr;
+}
+
+uring_writer::uring_writer(const std::string&, std::size_t, unsigned, bool)
+{
+        THROW_EXCEPTION << "io_uring is not supported";
+}
+
+uring_writer::~uring_writer() = default;
+
+char* uring_writer::commit(std::size_t) { return nullptr; }
+
+void uring_writer::close() {}
+
+#endif
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "file.hpp"
+
+struct iovec;
+
+/* A minimal io_uring on top of the raw syscalls, liburing isn't required.
+ * Every request carries user data which comes back with its completion */
+class uring
+{
+public:
+        struct completion
+        {
+                uint64_t user_data;
+                int32_t res;
+        };
+
+        explicit uring(unsigned entries);
+        ~uring();
+
+        uring(const uring&) = delete;
+        uring& operator=(const uring&) = delete;
+
+        /* false if the kernel refused to pin the buffers (RLIMIT_MEMLOCK),
+         * the requests go without the fixed buffers then */
+        bool register_buffers(const iovec* iov, unsigned n) noexcept;
+
+        /* buf_index - index of a registered buffer or -1 */
+        void read(int fd, void* buf, uint32_t len, uint64_t offset,
+                  uint64_t user_data, int buf_index = -1);
+
+        void write(int fd, const void* buf, uint32_t len, uint64_t offset,
+                   uint64_t user_data, int buf_index = -1);
+
+        /* hands the queued requests to the kernel without waiting */
+        void submit();
+
+        /* submits the queued requests and waits for a completion */
+        completion wait();
+
+        unsigned in_flight() const { return in_flight_; }
+
+        /* false if the running kernel doesn't provide io_uring */
+        static bool supported() noexcept;
+private:
+        void _queue(uint8_t opcode, int fd, const void* buf, uint32_t len,
+                    uint64_t offset, uint64_t user_data, int buf_index);
+
+        int _enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+
+        void _release() noexcept;
+private:
+        int fd_ = -1;
+        unsigned entries_ = 0;
+
+        void* sq_ptr_ = nullptr;
+        void* cq_ptr_ = nullptr;
+        std::size_t sq_size_ = 0, cq_size_ = 0;
+
+        void* sqes_ = nullptr;
+        std::size_t sqes_size_ = 0;
+
+        unsigned *sq_head_ = nullptr, *sq_tail_ = nullptr;
+        unsigned *sq_mask_ = nullptr, *sq_array_ = nullptr;
+        unsigned *cq_head_ = nullptr, *cq_tail_ = nullptr;
+        unsigned *cq_mask_ = nullptr;
+        void* cqes_ = nullptr;
+
+        unsigned to_submit_ = 0, in_flight_ = 0;
+        bool fixed_ = false;
+};
+
+/* Reads a file sequentially through a ring of buffers, all but the one
+ * being consumed are kept in flight, so the reader waits only if the
+ * device is slower than the consumer. Falls back to pread if io_uring is
+ * unavailable. direct - bypass the page cache (O_DIRECT) */
+class uring_reader
+{
+public:
+        /* size - the bytes read from the start, up to the whole file */
+        uring_reader(const std::string& filename, std::size_t buff_size,
+                     unsigned buff_n, bool direct = false,
+                     uint64_t size = (uint64_t)-1);
+        ~uring_reader();
+
+        uring_reader(const uring_reader&) = delete;
+        uring_reader& operator=(const uring_reader&) = delete;
+
+        /* the next block of the file, the previous one is handed back to
+         * the ring, nullptr at the end of the file */
+        const char* next_block(std::size_t& size);
+
+        uint64_t size() const { return size_; }
+        std::size_t buff_size() const { return block_size_ * slots_.size(); }
+
+        const std::string& filename() const { return filename_; }
+private:
+        struct slot
+        {
+                char* data;
+                uint64_t offset;
+                uint32_t len;
+                bool issued;
+                bool pending;
+        };
+
+        void _issue(unsigned i);
+        void _complete(const uring::completion& c);
+private:
+        std::string filename_;
+        int fd_ = -1;
+        bool direct_ = false;
+        uint64_t size_ = 0, next_offset_ = 0;
+
+        std::size_t block_size_ = 0;
+        aligned_buffer buffer_;
+        std::vector<slot> slots_;
+        unsigned cur_ = 0, last_ = (unsigned)-1;
+
+        std::unique_ptr<uring> ring_;
+};
+
+/* Writes a file sequentially: a full buffer is submitted and the writer
+ * moves on to the next one, it waits only when all of them are in flight.
+ * Falls back to pwrite if io_uring is unavailable. With O_DIRECT only the
+ * last block may be partial, it's padded and cut off on close */
+class uring_writer
+{
+public:
+        uring_writer(const std::string& filename, std::size_t buff_size,
+                     unsigned buff_n, bool direct = false);
+
+        /* waits for the writes in flight, the errors are ignored,
+         * call close() to get them */
+        ~uring_writer();
+
+        uring_writer(const uring_writer&) = delete;
+        uring_writer& operator=(const uring_writer&) = delete;
+
+        /* a free buffer to fill, block_size() bytes */
+        char* block() const { return slots_[cur_].data; }
+        std::size_t block_size() const { return block_size_; }
+
+        /* writes the first size bytes of the current block */
+        char* commit(std::size_t size);
+
+        /* waits for all the writes and closes the file */
+        void close();
+
+        std::size_t buff_size() const { return block_size_ * slots_.size(); }
+private:
+        struct slot
+        {
+                char* data;
+                uint64_t offset;
+                uint32_t len;
+                bool pending;
+        };
+
+        void _complete(const uring::completion& c);
+        void _drain();
+private:
+        std::string filename_;
+        int fd_ = -1;
+        bool direct_ = false;
+        uint64_t offset_ = 0, size_ = 0;
+
+        std::size_t block_size_ = 0;
+        aligned_buffer buffer_;
+        std::vector<slot> slots_;
+        unsigned cur_ = 0;
+
+        std::unique_ptr<uring> ring_;
+};
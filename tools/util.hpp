@@ -4,6 +4,11 @@
 #include <iomanip>
 #include <sstream>
 #include <cstring>
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 template<typename T>
 constexpr void set_flag(T* x, T flag)
@@ -141,3 +146,46 @@ inline void mem_copy(void* dst, const void* src, std::size_t size) noexcept
 {
         std::memcpy(dst, src, size);
 }
+
+/* Cache line sized block that is written with non-temporal stores */
+constexpr std::size_t STREAM_LINE_SIZE = 64;
+
+/* Copies size bytes bypassing the cache, the data goes straight to memory
+ * through the write-combining buffers and doesn't evict anything hot.
+ * dst must be aligned to STREAM_LINE_SIZE and size must be a product of it
+ * otherwise falls back to mem_copy. Must be followed by store_fence()
+ * before the data is read by someone else. */
+inline void mem_stream_copy(void* dst, const void* src, std::size_t size) noexcept
+{
+#if defined(__SSE2__)
+        if (((uintptr_t)dst % STREAM_LINE_SIZE) || (size % STREAM_LINE_SIZE))
+        {
+                mem_copy(dst, src, size);
+                return;
+        }
+
+        auto to = reinterpret_cast<__m128i*>(dst);
+        auto from = reinterpret_cast<const __m128i*>(src);
+        auto end = to + size / sizeof(__m128i);
+
+        while (to != end)
+        {
+                _mm_stream_si128(to + 0, _mm_loadu_si128(from + 0));
+                _mm_stream_si128(to + 1, _mm_loadu_si128(from + 1));
+                _mm_stream_si128(to + 2, _mm_loadu_si128(from + 2));
+                _mm_stream_si128(to + 3, _mm_loadu_si128(from + 3));
+
+                to += 4;
+                from += 4;
+        }
+#else
+        mem_copy(dst, src, size);
+#endif
+}
+
+inline void store_fence() noexcept
+{
+#if defined(__SSE2__)
+        _mm_sfence();
+#endif
+}